@@ -0,0 +1,42 @@
+-- lua bench.lua [worker] [key=value ...] [name ...] , see test/bench_<name>.lua
+-- key=value sets the config of ltask.init, for example :
+--   lua bench.lua 8 schedule ; lua bench.lua 32 schedule ; lua bench.lua 128 schedule
+--   lua bench.lua timer_resolution=100 timer
+--   lua bench.lua timer_add
+local core = {
+	worker = 0,	-- 0 : the number of cores - 1
+}
+local names = {}
+for i, v in ipairs { ... } do
+	local key, value = v:match "^([%w_]+)=(.*)$"
+	if key then
+		core[key] = math.tointeger(value) or value
+	elseif i == 1 and math.tointeger(v) then
+		core.worker = math.tointeger(v)
+	else
+		names[#names+1] = v
+	end
+end
+if #names == 0 then
+	names = { "mpsc" }
+end
+
+local start = require "test.start"
+start {
+    core = core,
+    service_path = "service/?.lua;test/?.lua",
+    bootstrap = {
+        {
+            name = "timer",
+            unique = true,
+        },
+        {
+            name = "logger",
+            unique = true,
+        },
+        {
+            name = "bench",
+            args = names,
+        },
+    },
+}
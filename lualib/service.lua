@@ -1,3 +1,4 @@
+local SERVICE_SYSTEM <const> = 0
 local SERVICE_ROOT <const> = 1
 
 local MESSAGE_SYSTEM <const> = 0
@@ -6,6 +7,8 @@ local MESSAGE_RESPONSE <const> = 2
 local MESSAGE_ERROR <const> = 3
 local MESSAGE_SIGNAL <const> = 4
 local MESSAGE_IDLE <const> = 5
+local MESSAGE_TIMER <const> = 6
+local MESSAGE_UNBLOCK <const> = 7
 
 local RECEIPT_DONE <const> = 1
 local RECEIPT_ERROR <const> = 2
@@ -59,6 +62,11 @@ local session_id = 2	-- 1 is reserved for root
 local session_waiting = {}
 local wakeup_queue = {}
 
+-- session of ltask.timeout -> timer handle (false if the response is posted directly)
+local timeout_handle = {}
+-- the cancelled timeout sessions whose responses are on the way
+local timeout_cancelled = {}
+
 ----- error handling ------
 
 local error_mt = {}
@@ -233,61 +241,136 @@ local function rethrow_error(level, errobj)
 	end
 end
 
-function ltask.post_message(addr, session, type, msg, sz)
-	ltask.send_message(addr, session, type, msg, sz)
-	continue_session()
-	return ltask.message_receipt()
+-- The messages blocked by the targets (too many messages are waiting in them), until MESSAGE_UNBLOCK from the target.
+-- address -> FIFO of { from, session, type, msg, sz }
+local blocked_messages = {}
+
+local function drop_blocked(addr, m)
+	ltask.remove(m[4], m[5])
+	if m[1] ~= CURRENT_SERVICE then
+		-- forwarded, see ltask.forward
+		ltask.rasie_error(m[1], m[2], string.format("{service:%d} is dead", addr))
+	end
 end
 
-local function send_blocked_message(addr, session, type, ...)
-	local msg, sz = ltask.pack("send_retry", addr, session, type, ...)
-	while true do
-		local receipt_type = ltask.post_message(SERVICE_ROOT, SESSION_SEND_MESSAGE, MESSAGE_REQUEST, msg, sz)
-		if receipt_type == RECEIPT_DONE then
+-- Send the blocked messages to addr in order, until it blocks again
+local function send_blocked(addr)
+	local q = blocked_messages[addr]
+	if q == nil then
+		return
+	end
+	for i = 1, #q do
+		local m = q[i]
+		local receipt_type, receipt_msg, receipt_sz = ltask.forward_message(addr, m[1], m[2], m[3], m[4], m[5])
+		if receipt_type == RECEIPT_BLOCK then
+			m[4], m[5] = receipt_msg, receipt_sz
+			blocked_messages[addr] = table.move(q, i, #q, 1, {})
+			return
+		elseif receipt_type == RECEIPT_ERROR then
+			m[4], m[5] = receipt_msg, receipt_sz
+			for j = i, #q do
+				drop_blocked(addr, q[j])
+			end
 			break
-		elseif receipt_type == RECEIPT_BLOCK then
-			ltask.sleep(1)
+		end
+	end
+	blocked_messages[addr] = nil
+end
+
+-- Never yield, the message waits in addr when its mailbox is full, or here when addr blocks it.
+-- Returns the receipt, and the message if addr is dead (RECEIPT_ERROR)
+local function deliver_message(addr, from, session, type, msg, sz)
+	local q = blocked_messages[addr]
+	if q then
+		-- keep the order
+		q[#q+1] = { from, session, type, msg, sz }
+		return RECEIPT_DONE
+	end
+	local receipt_type, receipt_msg, receipt_sz = ltask.forward_message(addr, from, session, type, msg, sz)
+	if receipt_type == RECEIPT_BLOCK then
+		blocked_messages[addr] = { { from, session, type, receipt_msg, receipt_sz } }
+		return RECEIPT_DONE
+	end
+	return receipt_type, receipt_msg, receipt_sz
+end
+
+-- Handle the failed messages in outbox which nobody waits for
+local function dispatch_bounce()
+	while true do
+		local receipt_type, addr, session, type, msg, sz = ltask.message_bounce()
+		if receipt_type == nil then
+			return
+		end
+		if receipt_type == RECEIPT_BLOCK then
+			-- wait in the target until its mailbox has room
+			local r, msg, sz = deliver_message(addr, CURRENT_SERVICE, session, type, msg, sz)
+			if r ~= RECEIPT_DONE then
+				ltask.remove(msg, sz)
+			end
 		else
-			-- error (root quit?)
+			-- RECEIPT_ERROR : dead service
 			ltask.remove(msg, sz)
-			break
 		end
 	end
 end
 
-local function post_request_message(addr, session, type, msg, sz)
-	local receipt_type, receipt_msg, receipt_sz = ltask.post_message(addr, session, type, msg, sz)
-	if receipt_type == RECEIPT_DONE then
+local function flush_outbox()
+	continue_session()
+	dispatch_bounce()
+end
+
+function ltask.post_message(addr, session, type, msg, sz)
+	if addr ~= SERVICE_SYSTEM then
+		-- push into the mailbox of addr directly, the receipt is immediate
+		return ltask.push_message(addr, session, type, msg, sz)
+	end
+	while not ltask.send_message(addr, session, type, msg, sz) do
+		flush_outbox()
+	end
+	continue_session()
+	return ltask.message_receipt()
+end
+
+-- Send a message without waiting for the receipt
+local function queue_message(addr, session, type, msg, sz)
+	if addr == SERVICE_SYSTEM then
+		-- yield only if the outbox is full
+		while not ltask.queue_message(addr, session, type, msg, sz) do
+			flush_outbox()
+		end
 		return
 	end
+	local receipt_type, receipt_msg, receipt_sz = deliver_message(addr, CURRENT_SERVICE, session, type, msg, sz)
 	if receipt_type == RECEIPT_ERROR then
 		ltask.remove(receipt_msg, receipt_sz)
-		if session ~= SESSION_SEND_MESSAGE then
-			error(string.format("{service:%d} is dead", addr))
-		end
-	else
-		--RECEIPT_BLOCK
-		-- todo: send again
-		ltask.remove(receipt_msg, receipt_sz)
-		error(string.format("{service:%d} is busy", addr))
 	end
 end
 
-local function post_response_message(addr, session, type, msg, sz)
+local function post_request_message(addr, session, type, msg, sz)
+	if session == SESSION_SEND_MESSAGE then
+		queue_message(addr, session, type, msg, sz)
+		return
+	end
+	if blocked_messages[addr] then
+		-- Don't overtake the blocked messages
+		ltask.remove(msg, sz)
+		error(string.format("{service:%d} is busy", addr))
+	end
 	local receipt_type, receipt_msg, receipt_sz = ltask.post_message(addr, session, type, msg, sz)
 	if receipt_type == RECEIPT_DONE then
 		return
 	end
+	ltask.remove(receipt_msg, receipt_sz)
 	if receipt_type == RECEIPT_ERROR then
-		ltask.remove(receipt_msg, receipt_sz)
+		error(string.format("{service:%d} is dead", addr))
 	else
 		--RECEIPT_BLOCK
-		ltask.fork(function ()
-			send_blocked_message(addr, session, type, ltask.unpack_remove(receipt_msg, receipt_sz))
-		end)
+		error(string.format("{service:%d} is busy", addr))
 	end
 end
 
+local post_response_message = queue_message
+
 function ltask.rasie_error(addr, session, message)
 	if session == SESSION_SEND_MESSAGE then
 		return
@@ -296,6 +379,16 @@ function ltask.rasie_error(addr, session, message)
 	post_response_message(addr, session, MESSAGE_ERROR, ltask.pack(errobj))
 end
 
+-- Forward a message received (msg, sz are not unpacked) to addr as-is. The sender is still from,
+-- so the response of a request goes back to from directly. from isn't checked, see lforward_message.
+function ltask.forward(addr, from, session, type, msg, sz)
+	local receipt_type, receipt_msg, receipt_sz = deliver_message(addr, from, session, type, msg, sz)
+	if receipt_type == RECEIPT_ERROR then
+		ltask.remove(receipt_msg, receipt_sz)
+		ltask.rasie_error(from, session, string.format("{service:%d} is dead", addr))
+	end
+end
+
 local function resume_session(co, ...)
 	running_thread = co
 	local ok, errobj = coroutine_resume(co, ...)
@@ -469,6 +562,94 @@ function ltask.sleep(ti)
 	yield_session()
 end
 
+local REACTOR_ERROR <const> = 4
+
+-- Wait until fd is readable ("r") or writable ("w", or "rw" for both) without blocking the worker.
+-- Needs .reactor in ltask.init. Returns readable, writable, error (or hangup)
+-- One coroutine can wait for read and another for write, but only one for each. Raises an error if
+-- the direction is waited already, or the fd is waited by another service.
+function ltask.wait_fd(fd, what)
+	ltask.reactor_add(fd, what or "r", session_id)
+	session_coroutine_suspend_lookup[session_id] = running_thread
+	session_id = session_id + 1
+	local _, _, _, events = yield_session()
+	events = events or 0
+	return events & 1 ~= 0, events & 2 ~= 0, events & 4 ~= 0
+end
+
+local function cancel_wait_fd(session)
+	local co = session_coroutine_suspend_lookup[session]
+	if co then
+		session_coroutine_suspend_lookup[session] = nil
+		wakeup_queue[#wakeup_queue+1] = { co, MESSAGE_RESPONSE, session, false, REACTOR_ERROR }
+	end
+end
+
+-- Stop waiting for fd, call it before closing fd. The waiting coroutines wake up with error.
+-- It raises an error if fd is waited by another service.
+function ltask.cancel_fd(fd)
+	local r, w = ltask.reactor_del(fd)
+	if r then
+		cancel_wait_fd(r)
+	end
+	if w then
+		cancel_wait_fd(w)
+	end
+end
+
+local function io_request(op, ...)
+	ltask.io_submit(session_id, op, ...)
+	session_coroutine_suspend_lookup[session_id] = running_thread
+	session_id = session_id + 1
+	local type, _, msg, sz = yield_session()
+	if type == MESSAGE_ERROR then
+		-- the io thread can't allocate the result
+		return nil, "Out of memory"
+	end
+	return ltask.io_result(msg, sz)
+end
+
+-- File I/O running in the io threads (set .io_thread in ltask.init), the service yields instead of blocking the worker.
+-- They return nil, errmsg, errno if failed, like io.open
+ltask.io = {}
+
+-- mode is the same as io.open, returns fd
+function ltask.io.open(filename, mode)
+	return io_request("open", filename, mode)
+end
+
+function ltask.io.close(fd)
+	return io_request("close", fd)
+end
+
+-- Read no more than size bytes from offset (the current position if it's nil), returns "" at the end of file.
+function ltask.io.read(fd, size, offset)
+	return io_request("read", fd, size, offset)
+end
+
+-- Returns the bytes written
+function ltask.io.write(fd, data, offset)
+	return io_request("write", fd, data, offset)
+end
+
+function ltask.io.fsync(fd)
+	return io_request("fsync", fd)
+end
+
+-- Run a C function (pushed by ltask_offload_pushfunc in src/offload.h, a lightuserdata is refused) in the io threads,
+-- and returns its result (a lightuserdata or nil) without blocking the worker.
+-- Raises an error if the io thread is out of memory, the result is lost then.
+function ltask.offload(func, arg)
+	ltask.offload_submit(session_id, func, arg)
+	session_coroutine_suspend_lookup[session_id] = running_thread
+	session_id = session_id + 1
+	local type, _, msg, sz = yield_session()
+	if type == MESSAGE_ERROR then
+		error "Offload : out of memory"
+	end
+	return ltask.offload_result(msg, sz)
+end
+
 function ltask.thread_info(thread)
 	local v = {}
 	v[".name"] = debug.getinfo(thread, 1, "n")
@@ -487,15 +668,34 @@ end
 
 function ltask.timeout(ti, func)
 	local co = new_thread(func)
-	session_coroutine_suspend_lookup[session_id] = co
+	local session = session_id
+	session_coroutine_suspend_lookup[session] = co
+	local handle = false
 	if ti == 0 then
-		if RECEIPT_DONE ~= ltask.post_message(CURRENT_SERVICE, session_id, MESSAGE_RESPONSE) then
-			ltask.timer_add(session_id, 0)
+		if RECEIPT_DONE ~= ltask.post_message(CURRENT_SERVICE, session, MESSAGE_RESPONSE) then
+			handle = ltask.timer_add(session, 0)
 		end
 	else
-		ltask.timer_add(session_id, ti)
+		handle = ltask.timer_add(session, ti)
 	end
+	timeout_handle[session] = handle
 	session_id = session_id + 1
+	return session
+end
+
+-- Cancel the timeout returned by ltask.timeout, returns false if func has been called.
+function ltask.cancel_timeout(session)
+	local handle = timeout_handle[session]
+	if handle == nil then
+		return false
+	end
+	timeout_handle[session] = nil
+	session_coroutine_suspend_lookup[session] = nil
+	if not (handle and ltask.timer_cancel(handle)) then
+		-- The response has been sent, ignore it
+		timeout_cancelled[session] = true
+	end
+	return true
 end
 
 local function wait_interrupt(errobj)
@@ -865,7 +1065,43 @@ SESSION[MESSAGE_REQUEST] = function (type, msg, sz)
 	request(ltask.unpack_remove(msg, sz))
 end
 
+-- f(from, session, msg, sz) sees each request before unpacking. It returns an address to forward
+-- the request to (by ltask.forward), or nil to unpack and dispatch it as usual.
+function ltask.forward_handler(f)
+	SESSION[MESSAGE_REQUEST] = function (type, msg, sz)
+		local from = session_coroutine_address[running_thread]
+		local session = session_coroutine_response[running_thread]
+		local addr = f(from, session, msg, sz)
+		if addr == nil then
+			request(ltask.unpack_remove(msg, sz))
+			return
+		end
+		-- addr sends the response
+		session_coroutine_address[running_thread] = nil
+		session_coroutine_response[running_thread] = nil
+		ltask.forward(addr, from, session, type, msg, sz)
+	end
+end
+
+local timer_sessions = {}
+
+local function wakeup_timer(session)
+	local co = session_coroutine_suspend_lookup[session]
+	if co == nil then
+		if timeout_cancelled[session] then
+			timeout_cancelled[session] = nil
+		else
+			print("Unknown timer session : ", session)
+		end
+	else
+		session_coroutine_suspend_lookup[session] = nil
+		timeout_handle[session] = nil
+		wakeup_session(co, MESSAGE_RESPONSE, session)
+	end
+end
+
 local function schedule_message()
+	dispatch_bounce()
 	local from, session, type, msg, sz = ltask.recv_message()
 	local f = SESSION[type]
 	if f then
@@ -875,12 +1111,25 @@ local function schedule_message()
 	elseif from == nil then
 		-- no message
 		return
+	elseif type == MESSAGE_UNBLOCK then
+		send_blocked(from)
+	elseif type == MESSAGE_TIMER then
+		-- a batch of expired timers
+		local n = ltask.unpack_timer(msg, sz, timer_sessions)
+		for i = 1, n do
+			wakeup_timer(timer_sessions[i])
+		end
 	else
 		local co = session_coroutine_suspend_lookup[session]
 		if co == nil then
-			print("Unknown response session : ", session, "from", from, "type", type, ltask.unpack_remove(msg, sz))
+			if timeout_cancelled[session] then
+				timeout_cancelled[session] = nil
+			else
+				print("Unknown response session : ", session, "from", from, "type", type, ltask.unpack_remove(msg, sz))
+			end
 		else
 			session_coroutine_suspend_lookup[session] = nil
+			timeout_handle[session] = nil
 			wakeup_session(co, type, session, msg, sz)
 		end
 	end
@@ -888,14 +1137,32 @@ local function schedule_message()
 		local s = table.remove(wakeup_queue, 1)
 		wakeup_session(table.unpack(s))
 	end
+	return true
 end
 
 print = ltask.log.info
 
 local function mainloop()
 	while true do
-		schedule_message()
+		-- Handle a batch of messages in one resume, see .batch and .batch_time in ltask.init
+		local n = 0
+		while schedule_message() and not quit do
+			n = n + 1
+			if not ltask.resume_budget(n) then
+				break
+			end
+		end
 		if quit then
+			-- Don't lose the blocked messages, park them in the targets anyway
+			for addr, q in pairs(blocked_messages) do
+				for i = 1, #q do
+					local m = q[i]
+					local receipt_type, receipt_msg, receipt_sz = ltask.forward_message(addr, m[1], m[2], m[3], m[4], m[5], true)
+					if receipt_type == RECEIPT_ERROR then
+						ltask.remove(receipt_msg, receipt_sz)
+					end
+				end
+			end
 			ltask.log.info "quit."
 			return
 		end
@@ -11,7 +11,6 @@ local MESSAGE_SCHEDULE_NEW <const> = 0
 local MESSAGE_SCHEDULE_DEL <const> = 1
 
 local RECEIPT_ERROR <const> = 2
-local RECEIPT_BLOCK <const> = 3
 local RECEIPT_RESPONCE <const> = 4
 
 local S = {}
@@ -50,61 +49,6 @@ do
 	ltask.suspend(1, init_receipt)
 end
 
-local retry_queue
-
-local function send_retry_queue(addr, queue)
-	local n = #queue
-	for i = 1, n do
-		local type = ltask.post_message(addr, table.unpack(queue[i]))
-		if type == RECEIPT_BLOCK then
-			table.move(queue, i, n, 1)
-			return true
-		elseif type == RECEIPT_ERROR then
-			for j = i, n do
-				local msg, sz = queue[j][3], queue[j][4]
-				ltask.remove(msg, sz)
-			end
-			return
-		end
-	end
-end
-
-local function send_all_retry()
-	while true do
-		local removed = {}
-		for addr, queue in pairs(retry_queue) do
-			if not send_retry_queue(addr, queue) then
-				removed[addr] = true
-			end
-		end
-		for addr in pairs(removed) do
-			retry_queue[addr] = nil
-		end
-		if next(retry_queue) == nil then
-			break
-		end
-		ltask.sleep(1)
-	end
-	retry_queue = nil
-end
-
-function S.send_retry(addr, session, type, ...)
-	local message = { session, type, ltask.pack(...) }
-	if retry_queue then
-		local q = retry_queue[addr]
-		if q then
-			q[#q+1] = message
-		else
-			retry_queue[addr] = { message }
-		end
-	else
-		retry_queue = {
-			[addr] = { message },
-		}
-		ltask.fork(send_all_retry)
-	end
-end
-
 local function register_service(address, name)
 	if named_services[name] then
 		error(("Name `%s` already exists."):format(name))
@@ -266,6 +210,13 @@ do -- external message handler
 			ltask.send(external_forwarding, external_name or "external", msg)
 		end
 	end
+
+	-- The external messages are packed as ("external", msg) by the system, forward them as-is if the name is the same.
+	ltask.forward_handler(function (from, session)
+		if from == SERVICE_SYSTEM and external_forwarding and (external_name or "external") == "external" then
+			return external_forwarding
+		end
+	end)
 end
 
 local function quit()
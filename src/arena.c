@@ -0,0 +1,193 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define ARENA_ALIGN 16
+#define ARENA_CLASSES 16
+#define ARENA_MAXSIZE (ARENA_ALIGN * ARENA_CLASSES)
+#define ARENA_PAGE 4096
+
+struct arena_free {
+	struct arena_free *next;
+};
+
+struct arena_page {
+	struct arena_page *next;
+	// keep the blocks aligned
+	union {
+		uint8_t data[ARENA_PAGE];
+		long double align;
+	} u;
+};
+
+// The large blocks (from malloc) are linked too, so arena_delete() frees them. A large block which can't be
+// shrunk (out of memory) stays in the list, even after it's used as a small block.
+struct arena_large {
+	struct arena_large *prev;
+	struct arena_large *next;
+};
+
+// keep the blocks aligned
+#define LARGE_HEADER ((sizeof(struct arena_large) + ARENA_ALIGN - 1) / ARENA_ALIGN * ARENA_ALIGN)
+
+struct arena_class {
+	struct arena_free *free;
+	// unused space of the last page
+	uint8_t *ptr;
+	uint8_t *end;
+};
+
+struct arena {
+	struct arena_page *pages;
+	struct arena_large *large;
+	struct arena_class c[ARENA_CLASSES];
+};
+
+static inline int
+size_class(size_t sz) {
+	return (int)((sz + ARENA_ALIGN - 1) / ARENA_ALIGN) - 1;
+}
+
+struct arena *
+arena_new() {
+	struct arena *a = (struct arena *)malloc(sizeof(*a));
+	if (a == NULL)
+		return NULL;
+	memset(a, 0, sizeof(*a));
+	return a;
+}
+
+void
+arena_delete(struct arena *a) {
+	if (a == NULL)
+		return;
+	struct arena_page *p = a->pages;
+	while (p) {
+		struct arena_page *next = p->next;
+		free(p);
+		p = next;
+	}
+	struct arena_large *l = a->large;
+	while (l) {
+		struct arena_large *next = l->next;
+		free(l);
+		l = next;
+	}
+	free(a);
+}
+
+static void *
+class_alloc(struct arena *a, int id) {
+	struct arena_class *c = &a->c[id];
+	struct arena_free *f = c->free;
+	if (f) {
+		c->free = f->next;
+		return f;
+	}
+	size_t sz = (size_t)(id + 1) * ARENA_ALIGN;
+	if ((size_t)(c->end - c->ptr) < sz) {
+		// The rest of the last page is wasted
+		struct arena_page *p = (struct arena_page *)malloc(sizeof(*p));
+		if (p == NULL)
+			return NULL;
+		p->next = a->pages;
+		a->pages = p;
+		c->ptr = p->u.data;
+		c->end = p->u.data + ARENA_PAGE;
+	}
+	void *r = c->ptr;
+	c->ptr += sz;
+	return r;
+}
+
+static inline void
+class_free(struct arena *a, int id, void *ptr) {
+	struct arena_class *c = &a->c[id];
+	struct arena_free *f = (struct arena_free *)ptr;
+	f->next = c->free;
+	c->free = f;
+}
+
+static inline struct arena_large *
+large_header(void *ptr) {
+	return (struct arena_large *)((uint8_t *)ptr - LARGE_HEADER);
+}
+
+static void *
+large_alloc(struct arena *a, size_t sz) {
+	struct arena_large *l = (struct arena_large *)malloc(LARGE_HEADER + sz);
+	if (l == NULL)
+		return NULL;
+	l->prev = NULL;
+	l->next = a->large;
+	if (a->large)
+		a->large->prev = l;
+	a->large = l;
+	return (uint8_t *)l + LARGE_HEADER;
+}
+
+static void
+large_free(struct arena *a, void *ptr) {
+	struct arena_large *l = large_header(ptr);
+	if (l->prev)
+		l->prev->next = l->next;
+	else
+		a->large = l->next;
+	if (l->next)
+		l->next->prev = l->prev;
+	free(l);
+}
+
+static void *
+large_realloc(struct arena *a, void *ptr, size_t sz) {
+	struct arena_large *l = (struct arena_large *)realloc(large_header(ptr), LARGE_HEADER + sz);
+	if (l == NULL)
+		return NULL;
+	// relink the moved one
+	if (l->prev)
+		l->prev->next = l;
+	else
+		a->large = l;
+	if (l->next)
+		l->next->prev = l;
+	return (uint8_t *)l + LARGE_HEADER;
+}
+
+void *
+arena_alloc(struct arena *a, size_t sz) {
+	if (sz > ARENA_MAXSIZE)
+		return large_alloc(a, sz);
+	return class_alloc(a, size_class(sz));
+}
+
+void
+arena_free(struct arena *a, void *ptr, size_t sz) {
+	if (ptr == NULL)
+		return;
+	if (sz > ARENA_MAXSIZE)
+		large_free(a, ptr);
+	else
+		class_free(a, size_class(sz), ptr);
+}
+
+void *
+arena_realloc(struct arena *a, void *ptr, size_t osz, size_t nsz) {
+	if (osz > ARENA_MAXSIZE && nsz > ARENA_MAXSIZE) {
+		void *r = large_realloc(a, ptr, nsz);
+		return (r == NULL && nsz <= osz) ? ptr : r;
+	}
+	if (osz <= ARENA_MAXSIZE && nsz <= ARENA_MAXSIZE && size_class(osz) == size_class(nsz))
+		return ptr;
+	void *r = arena_alloc(a, nsz);
+	if (r == NULL) {
+		if (nsz > osz)
+			return NULL;
+		// lua assumes shrinking never fails, keep the larger block.
+		// A large one goes to a freelist after it's freed, and arena_delete() frees it (it's still linked).
+		return ptr;
+	}
+	memcpy(r, ptr, osz < nsz ? osz : nsz);
+	arena_free(a, ptr, osz);
+	return r;
+}
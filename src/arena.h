@@ -0,0 +1,17 @@
+#ifndef ltask_arena_h
+#define ltask_arena_h
+
+#include <stddef.h>
+
+// Per service allocator for lua state, not thread safe (only the worker running the service uses it).
+// Small blocks come from size-classed slabs, large blocks from malloc.
+struct arena;
+
+struct arena * arena_new();
+// release all the slabs and the large blocks
+void arena_delete(struct arena *);
+void * arena_alloc(struct arena *, size_t sz);
+void arena_free(struct arena *, void *ptr, size_t sz);
+void * arena_realloc(struct arena *, void *ptr, size_t osz, size_t nsz);
+
+#endif
@@ -7,6 +7,12 @@
 
 typedef atomic_uintptr_t atomic_ptr;
 
+// Put the atomics written by different threads into different cache lines to avoid false sharing
+#define CACHE_LINE_SIZE 64
+#define CACHE_LINE_PAD(name, sz) char name[CACHE_LINE_SIZE - (sz)]
+// For the structs allocated with CACHE_LINE_SIZE alignment
+#define CACHE_LINE_ALIGN _Alignas(CACHE_LINE_SIZE)
+
 static inline void
 atomic_int_init(atomic_int *aint, int v) {
 	atomic_init(aint, v);
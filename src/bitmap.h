@@ -0,0 +1,90 @@
+#ifndef ltask_bitmap_h
+#define ltask_bitmap_h
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+// Atomic bitmap, one bit per worker. Enough for MAX_WORKER.
+#define BITMAP_BITS 256
+#define BITMAP_WORDS ((BITMAP_BITS + 63) / 64)
+
+struct bitmap {
+	atomic_ullong bits[BITMAP_WORDS];
+};
+
+static inline int
+bitmap_ctz(uint64_t x) {
+#if defined(_MSC_VER)
+	unsigned long r;
+	_BitScanForward64(&r, x);
+	return (int)r;
+#else
+	return __builtin_ctzll(x);
+#endif
+}
+
+static inline void
+bitmap_init(struct bitmap *b) {
+	int i;
+	for (i=0;i<BITMAP_WORDS;i++) {
+		atomic_init(&b->bits[i], 0);
+	}
+}
+
+static inline int
+bitmap_words(int n) {
+	return (n + 63) / 64;
+}
+
+static inline void
+bitmap_set(struct bitmap *b, int i) {
+	atomic_fetch_or(&b->bits[i / 64], (unsigned long long)1 << (i % 64));
+}
+
+static inline void
+bitmap_clear(struct bitmap *b, int i) {
+	atomic_fetch_and(&b->bits[i / 64], ~((unsigned long long)1 << (i % 64)));
+}
+
+static inline uint64_t
+bitmap_word(struct bitmap *b, int w) {
+	return atomic_load(&b->bits[w]);
+}
+
+// Read a word and clear it
+static inline uint64_t
+bitmap_take(struct bitmap *b, int w) {
+	return atomic_exchange(&b->bits[w], 0);
+}
+
+// Remove the lowest bit of *bits and returns its index
+static inline int
+bitmap_pop(uint64_t *bits) {
+	int r = bitmap_ctz(*bits);
+	*bits &= *bits - 1;
+	return r;
+}
+
+// Returns the first set bit in [from, n), or n if none
+static inline int
+bitmap_find(struct bitmap *b, int from, int n) {
+	if (from >= n)
+		return n;
+	int w = from / 64;
+	uint64_t bits = bitmap_word(b, w) & (~(uint64_t)0 << (from % 64));
+	for (;;) {
+		if (bits) {
+			int r = w * 64 + bitmap_ctz(bits);
+			return r < n ? r : n;
+		}
+		if (++w >= bitmap_words(n))
+			return n;
+		bits = bitmap_word(b, w);
+	}
+}
+
+#endif
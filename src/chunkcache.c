@@ -0,0 +1,372 @@
+#include "chunkcache.h"
+#include "spinlock.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#define CHUNKCACHE_SLOTS 256
+
+// The cache is limited by the bytes of the sources and the bytecode, the least recently used chunks are evicted.
+// A chunk is referenced while its bytecode is loading (without the lock), an evicted chunk is freed by the last one.
+struct chunk {
+	struct chunk *next;
+	// LRU list, the most recently used one is at the head
+	struct chunk *lru_prev;
+	struct chunk *lru_next;
+	int ref;
+	int evicted;
+	uint64_t hash;
+	size_t source_sz;
+	size_t code_sz;
+	const char *chunkname;
+	const char *source;
+	const char *code;
+};
+
+struct chunkcache {
+	struct spinlock lock;
+	int init;
+	int n;
+	size_t bytes;
+	size_t limit;
+	struct chunk *lru_head;
+	struct chunk *lru_tail;
+	atomic_ullong hit;
+	atomic_ullong miss;
+	struct chunk *slot[CHUNKCACHE_SLOTS];
+};
+
+static struct chunkcache G;
+
+void
+chunkcache_init(size_t limit) {
+	if (G.init)
+		return;
+	spinlock_init(&G.lock);
+	G.n = 0;
+	G.bytes = 0;
+	G.limit = limit;
+	G.lru_head = NULL;
+	G.lru_tail = NULL;
+	atomic_init(&G.hit, 0);
+	atomic_init(&G.miss, 0);
+	memset(G.slot, 0, sizeof(G.slot));
+	G.init = 1;
+}
+
+void
+chunkcache_exit() {
+	if (!G.init)
+		return;
+	int i;
+	for (i=0;i<CHUNKCACHE_SLOTS;i++) {
+		struct chunk *c = G.slot[i];
+		while (c) {
+			struct chunk *next = c->next;
+			free(c);
+			c = next;
+		}
+		G.slot[i] = NULL;
+	}
+	G.lru_head = NULL;
+	G.lru_tail = NULL;
+	spinlock_destroy(&G.lock);
+	G.init = 0;
+}
+
+// FNV-1a
+static uint64_t
+hash_string(uint64_t h, const char *str, size_t sz) {
+	size_t i;
+	for (i=0;i<sz;i++) {
+		h ^= (uint8_t)str[i];
+		h *= 0x100000001b3ull;
+	}
+	return h;
+}
+
+static inline int
+chunk_match(struct chunk *c, uint64_t hash, const char *source, size_t sz, const char *chunkname) {
+	return c->hash == hash
+		&& c->source_sz == sz
+		&& strcmp(c->chunkname, chunkname) == 0
+		&& memcmp(c->source, source, sz) == 0;
+}
+
+static inline size_t
+chunk_size(struct chunk *c) {
+	return c->source_sz + c->code_sz;
+}
+
+// Calling with G.lock
+static void
+lru_remove(struct chunk *c) {
+	if (c->lru_prev)
+		c->lru_prev->lru_next = c->lru_next;
+	else
+		G.lru_head = c->lru_next;
+	if (c->lru_next)
+		c->lru_next->lru_prev = c->lru_prev;
+	else
+		G.lru_tail = c->lru_prev;
+	c->lru_prev = NULL;
+	c->lru_next = NULL;
+}
+
+// Calling with G.lock
+static void
+lru_push(struct chunk *c) {
+	c->lru_prev = NULL;
+	c->lru_next = G.lru_head;
+	if (G.lru_head)
+		G.lru_head->lru_prev = c;
+	else
+		G.lru_tail = c;
+	G.lru_head = c;
+}
+
+// Calling with G.lock. Returns the chunk if it can be freed (not referenced)
+static struct chunk *
+chunk_evict(struct chunk *c) {
+	struct chunk **p = &G.slot[c->hash % CHUNKCACHE_SLOTS];
+	while (*p != c) {
+		p = &(*p)->next;
+	}
+	*p = c->next;
+	lru_remove(c);
+	--G.n;
+	G.bytes -= chunk_size(c);
+	if (c->ref > 0) {
+		c->evicted = 1;
+		return NULL;
+	}
+	return c;
+}
+
+// Returns the chunk referenced, release it by chunk_release() after loading
+static struct chunk *
+chunk_find(uint64_t hash, const char *source, size_t sz, const char *chunkname) {
+	spinlock_acquire(&G.lock);
+	struct chunk *c = G.slot[hash % CHUNKCACHE_SLOTS];
+	while (c && !chunk_match(c, hash, source, sz, chunkname)) {
+		c = c->next;
+	}
+	if (c) {
+		++c->ref;
+		lru_remove(c);
+		lru_push(c);
+	}
+	spinlock_release(&G.lock);
+	return c;
+}
+
+static void
+chunk_release(struct chunk *c) {
+	spinlock_acquire(&G.lock);
+	if (--c->ref > 0 || !c->evicted)
+		c = NULL;
+	spinlock_release(&G.lock);
+	free(c);
+}
+
+// Others may compile the same source at the same time, keep the first one.
+static void
+chunk_insert(struct chunk *c) {
+	if (chunk_size(c) > G.limit) {
+		free(c);
+		return;
+	}
+	struct chunk *freelist = NULL;
+	spinlock_acquire(&G.lock);
+	struct chunk **slot = &G.slot[c->hash % CHUNKCACHE_SLOTS];
+	struct chunk *p = *slot;
+	while (p && !chunk_match(p, c->hash, c->source, c->source_sz, c->chunkname)) {
+		p = p->next;
+	}
+	if (p == NULL) {
+		// Evict the least recently used ones
+		while (G.bytes + chunk_size(c) > G.limit) {
+			struct chunk *e = chunk_evict(G.lru_tail);
+			if (e) {
+				e->next = freelist;
+				freelist = e;
+			}
+		}
+		c->next = *slot;
+		*slot = c;
+		lru_push(c);
+		++G.n;
+		G.bytes += chunk_size(c);
+		c = NULL;
+	}
+	spinlock_release(&G.lock);
+	free(c);
+	while (freelist) {
+		struct chunk *next = freelist->next;
+		free(freelist);
+		freelist = next;
+	}
+}
+
+// The chunkname, source and bytecode are in the same block after the header.
+static struct chunk *
+chunk_new(uint64_t hash, const char *source, size_t sz, const char *chunkname, const void *code, size_t code_sz) {
+	size_t name_sz = strlen(chunkname) + 1;
+	struct chunk *c = (struct chunk *)malloc(sizeof(*c) + name_sz + sz + code_sz);
+	if (c == NULL)
+		return NULL;
+	char *data = (char *)(c + 1);
+	c->next = NULL;
+	c->lru_prev = NULL;
+	c->lru_next = NULL;
+	c->ref = 0;
+	c->evicted = 0;
+	c->hash = hash;
+	c->source_sz = sz;
+	c->code_sz = code_sz;
+	memcpy(data, chunkname, name_sz);
+	c->chunkname = data;
+	data += name_sz;
+	memcpy(data, source, sz);
+	c->source = data;
+	data += sz;
+	memcpy(data, code, code_sz);
+	c->code = data;
+	return c;
+}
+
+struct dump_buffer {
+	char *buf;
+	size_t sz;
+	size_t cap;
+};
+
+static int
+dump_writer(lua_State *L, const void *p, size_t sz, void *ud) {
+	struct dump_buffer *b = (struct dump_buffer *)ud;
+	if (b->sz + sz > b->cap) {
+		size_t cap = b->cap ? b->cap : 4096;
+		while (cap < b->sz + sz)
+			cap *= 2;
+		char *buf = (char *)realloc(b->buf, cap);
+		if (buf == NULL)
+			return 1;
+		b->buf = buf;
+		b->cap = cap;
+	}
+	memcpy(b->buf + b->sz, p, sz);
+	b->sz += sz;
+	return 0;
+}
+
+int
+chunkcache_load(lua_State *L, const char *source, size_t sz, const char *chunkname) {
+	if (!G.init || G.limit == 0 || sz == 0 || source[0] == LUA_SIGNATURE[0]) {
+		// bytecode is not cached
+		return luaL_loadbuffer(L, source, sz, chunkname);
+	}
+	const char *key = chunkname ? chunkname : "";
+	uint64_t hash = hash_string(hash_string(0xcbf29ce484222325ull, key, strlen(key) + 1), source, sz);
+	struct chunk *c = chunk_find(hash, source, sz, key);
+	if (c) {
+		atomic_fetch_add(&G.hit, 1);
+		int r = luaL_loadbufferx(L, c->code, c->code_sz, chunkname, "b");
+		chunk_release(c);
+		return r;
+	}
+	atomic_fetch_add(&G.miss, 1);
+	int r = luaL_loadbuffer(L, source, sz, chunkname);
+	if (r != LUA_OK)
+		return r;
+	// Keep the debug info, the tracebacks are the same as loading from source.
+	struct dump_buffer b = { NULL, 0, 0 };
+	if (lua_dump(L, dump_writer, &b, 0) == 0 && b.buf) {
+		c = chunk_new(hash, source, sz, key, b.buf, b.sz);
+		if (c)
+			chunk_insert(c);
+	}
+	free(b.buf);
+	return LUA_OK;
+}
+
+static char *
+read_file(FILE *f, size_t *sz) {
+	size_t cap = 4096;
+	size_t n = 0;
+	char *buf = (char *)malloc(cap);
+	if (buf == NULL)
+		return NULL;
+	for (;;) {
+		n += fread(buf + n, 1, cap - n, f);
+		if (n < cap)
+			break;
+		cap *= 2;
+		char *tmp = (char *)realloc(buf, cap);
+		if (tmp == NULL) {
+			free(buf);
+			return NULL;
+		}
+		buf = tmp;
+	}
+	if (ferror(f)) {
+		free(buf);
+		return NULL;
+	}
+	*sz = n;
+	return buf;
+}
+
+int
+chunkcache_loadfile(lua_State *L, const char *filename, const char *mode) {
+	FILE *f = fopen(filename, "rb");
+	if (f == NULL) {
+		lua_pushfstring(L, "cannot open %s: %s", filename, strerror(errno));
+		return LUA_ERRFILE;
+	}
+	size_t sz = 0;
+	char *buf = read_file(f, &sz);
+	fclose(f);
+	if (buf == NULL) {
+		lua_pushfstring(L, "cannot read %s", filename);
+		return LUA_ERRFILE;
+	}
+	const char *source = buf;
+	if (sz > 0 && source[0] == '#') {
+		// skip the first line (unix exec. file), but keep the '\n' for the line numbers
+		while (sz > 0 && source[0] != '\n') {
+			++source;
+			--sz;
+		}
+	}
+	const char *chunkname = lua_pushfstring(L, "@%s", filename);
+	int r;
+	if ((sz > 0 && source[0] == LUA_SIGNATURE[0]) || (mode && strchr(mode, 't') == NULL)) {
+		r = luaL_loadbufferx(L, source, sz, chunkname, mode);
+	} else {
+		r = chunkcache_load(L, source, sz, chunkname);
+	}
+	free(buf);
+	lua_remove(L, -2);
+	return r;
+}
+
+void
+chunkcache_stat(struct chunkcache_stat *s) {
+	if (!G.init) {
+		memset(s, 0, sizeof(*s));
+		return;
+	}
+	spinlock_acquire(&G.lock);
+	s->n = G.n;
+	s->bytes = G.bytes;
+	s->limit = G.limit;
+	spinlock_release(&G.lock);
+	s->hit = atomic_load(&G.hit);
+	s->miss = atomic_load(&G.miss);
+}
@@ -0,0 +1,30 @@
+#ifndef ltask_chunkcache_h
+#define ltask_chunkcache_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Process-wide cache of the compiled lua chunks. A source (with the same chunkname) is parsed only once,
+// the other services load its bytecode.
+
+struct lua_State;
+
+struct chunkcache_stat {
+	// 缓存的代码块数量，以及源代码和字节码占用的内存（不超过 limit ）
+	int n;
+	size_t bytes;
+	size_t limit;
+	uint64_t hit;
+	uint64_t miss;
+};
+
+// The sources and the bytecode are no more than limit bytes, the least recently used chunks are evicted. 0 : no cache
+void chunkcache_init(size_t limit);
+void chunkcache_exit();
+// The same as luaL_loadbuffer : returns LUA_OK and pushes the function, or pushes the error message
+int chunkcache_load(struct lua_State *L, const char *source, size_t sz, const char *chunkname);
+// The same as luaL_loadfilex, but the text chunks are cached (the content of file is the key).
+int chunkcache_loadfile(struct lua_State *L, const char *filename, const char *mode);
+void chunkcache_stat(struct chunkcache_stat *s);
+
+#endif
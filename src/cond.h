@@ -1,6 +1,8 @@
 #ifndef ltask_cond_h
 #define ltask_cond_h
 
+#include <stdint.h>
+
 #if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
 
 #include <windows.h>
@@ -61,9 +63,21 @@ cond_wait(struct cond *c) {
         SleepConditionVariableSRW(&c->c, &c->lock, INFINITE, 0);
 }
 
+// Wait until triggered or timeout (in 1/1000000s)
+static inline void
+cond_timedwait(struct cond *c, uint64_t usec) {
+	DWORD msec = (DWORD)((usec + 999) / 1000);
+	while (!c->flag) {
+		if (!SleepConditionVariableSRW(&c->c, &c->lock, msec, 0))
+			break;
+	}
+}
+
 #else
 
 #include <pthread.h>
+#include <time.h>
+#include <errno.h>
 
 struct cond {
     pthread_cond_t c;
@@ -74,7 +88,16 @@ struct cond {
 static inline void
 cond_create(struct cond *c) {
 	pthread_mutex_init(&c->lock, NULL);
+#if defined(__APPLE__)
 	pthread_cond_init(&c->c, NULL);
+#else
+	// cond_timedwait uses monotonic clock
+	pthread_condattr_t attr;
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&c->c, &attr);
+	pthread_condattr_destroy(&attr);
+#endif
 	c->flag = 0;    
 }
 
@@ -117,6 +140,33 @@ cond_wait(struct cond *c) {
 		pthread_cond_wait(&c->c, &c->lock);
 }
 
+// Wait until triggered or timeout (in 1/1000000s)
+static inline void
+cond_timedwait(struct cond *c, uint64_t usec) {
+	struct timespec ti;
+	ti.tv_sec = usec / 1000000;
+	ti.tv_nsec = (usec % 1000000) * 1000;
+#if defined(__APPLE__)
+	while (!c->flag) {
+		if (pthread_cond_timedwait_relative_np(&c->c, &c->lock, &ti) == ETIMEDOUT)
+			break;
+	}
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	ti.tv_sec += now.tv_sec;
+	ti.tv_nsec += now.tv_nsec;
+	if (ti.tv_nsec >= 1000000000) {
+		ti.tv_nsec -= 1000000000;
+		++ti.tv_sec;
+	}
+	while (!c->flag) {
+		if (pthread_cond_timedwait(&c->c, &c->lock, &ti) == ETIMEDOUT)
+			break;
+	}
+#endif
+}
+
 #endif
 
 #endif
@@ -19,6 +19,21 @@ config_getint(lua_State *L, int index, const char *key, int opt) {
 	return r;
 }
 
+static int
+config_getboolean(lua_State *L, int index, const char *key, int opt) {
+	int t = lua_getfield(L, index, key);
+	if (t == LUA_TNIL) {
+		lua_pop(L, 1);
+		return opt;
+	}
+	if (t != LUA_TBOOLEAN) {
+		return luaL_error(L, ".%s should be a boolean", key);
+	}
+	int r = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	return r;
+}
+
 static inline int
 align_pow2(int x) {
 	int r = 1;
@@ -45,8 +60,38 @@ config_load(lua_State *L, int index, struct ltask_config *config) {
 	}
 	config->queue = config_getint(L, index, "queue", DEFAULT_QUEUE);
 	config->queue = align_pow2(config->queue);
+	config->queue_init = config_getint(L, index, "queue_init", DEFAULT_QUEUE_INIT);
+	config->queue_init = align_pow2(config->queue_init);
+	if (config->queue_init > config->queue)
+		config->queue_init = config->queue;
 	config->queue_sending = config_getint(L, index, "queue_sending", DEFAULT_QUEUE_SENDING);
 	config->queue_sending = align_pow2(config->queue_sending);
+	config->outbox = config_getint(L, index, "outbox", DEFAULT_OUTBOX);
+	config->outbox = align_pow2(config->outbox);
+	if (config->outbox < 2)
+		config->outbox = 2;	// one slot is reserved for the signal
+	config->batch = config_getint(L, index, "batch", DEFAULT_BATCH);
+	if (config->batch < 1)
+		config->batch = 1;
+	config->batch_time = config_getint(L, index, "batch_time", DEFAULT_BATCH_TIME);
+	config->arena = config_getboolean(L, index, "arena", 0);
+	config->timer_resolution = config_getint(L, index, "timer_resolution", DEFAULT_TIMER_RESOLUTION);
+	if (config->timer_resolution <= 0 || 10000 % config->timer_resolution != 0) {
+		luaL_error(L, "Invalid timer_resolution %d", config->timer_resolution);
+		return;
+	}
+	config->sockevent = config_getint(L, index, "sockevent", DEFAULT_SOCKEVENT);
+	if (config->sockevent < 0)
+		config->sockevent = 0;
+	config->reactor = config_getboolean(L, index, "reactor", 0);
+	config->io_thread = config_getint(L, index, "io_thread", 0);
+	if (config->io_thread < 0)
+		config->io_thread = 0;
+	if (config->io_thread > MAX_IOTHREAD)
+		config->io_thread = MAX_IOTHREAD;
+	config->chunkcache = config_getint(L, index, "chunkcache", DEFAULT_CHUNKCACHE);
+	if (config->chunkcache < 0)
+		config->chunkcache = 0;
 	config->max_service = config_getint(L, index, "max_service", DEFAULT_MAX_SERVICE);
 	config->external_queue = config_getint(L, index, "external_queue", 0);
 	config->max_service = align_pow2(config->max_service);
@@ -67,6 +112,26 @@ config_load(lua_State *L, int index, struct ltask_config *config) {
 	lua_setfield(L, index, "worker");
 	lua_pushinteger(L, config->queue);
 	lua_setfield(L, index, "queue");
+	lua_pushinteger(L, config->queue_init);
+	lua_setfield(L, index, "queue_init");
+	lua_pushinteger(L, config->outbox);
+	lua_setfield(L, index, "outbox");
+	lua_pushinteger(L, config->batch);
+	lua_setfield(L, index, "batch");
+	lua_pushinteger(L, config->batch_time);
+	lua_setfield(L, index, "batch_time");
+	lua_pushboolean(L, config->arena);
+	lua_setfield(L, index, "arena");
+	lua_pushinteger(L, config->timer_resolution);
+	lua_setfield(L, index, "timer_resolution");
+	lua_pushinteger(L, config->sockevent);
+	lua_setfield(L, index, "sockevent");
+	lua_pushboolean(L, config->reactor);
+	lua_setfield(L, index, "reactor");
+	lua_pushinteger(L, config->io_thread);
+	lua_setfield(L, index, "io_thread");
+	lua_pushinteger(L, config->chunkcache);
+	lua_setfield(L, index, "chunkcache");
 	lua_pushinteger(L, config->max_service);
 	lua_setfield(L, index, "max_service");
 	lua_pushvalue(L, index);
@@ -5,9 +5,16 @@
 
 #define DEFAULT_MAX_SERVICE 65536
 #define DEFAULT_QUEUE 4096
+#define DEFAULT_QUEUE_INIT 16
 #define DEFAULT_QUEUE_SENDING DEFAULT_QUEUE
+#define DEFAULT_OUTBOX 64
+#define DEFAULT_BATCH 16
+#define DEFAULT_BATCH_TIME 1000
+#define DEFAULT_TIMER_RESOLUTION 10000
 #define MAX_WORKER 256
-#define MAX_SOCKEVENT 16
+#define MAX_IOTHREAD 64
+#define DEFAULT_SOCKEVENT 256
+#define DEFAULT_CHUNKCACHE (64 * 1024 * 1024)
 
 // 配置 Ltask 系统运行参数的结构体
 struct ltask_config {
@@ -15,11 +22,42 @@ struct ltask_config {
 	int worker;
 
 	// 系统中的消息队列数量。每个队列可用于存储需要处理的消息，以便工作线程按需提取和处理。
+	// 服务的消息队列（mailbox）按需增长，这是它的容量上限。
 	int queue;
 
+	// 服务消息队列的初始容量，第一条消息到达时才分配，满了以后加倍，直到 queue 。
+	int queue_init;
+
 	// 发送队列的大小或数量。该字段控制消息在发送过程中可以使用的队列数量，以便不同服务之间的消息传输更加高效
 	int queue_sending;
 
+	// 每个服务发件箱的容量，服务一次运行中最多可以投递这么多条消息而不需要让出。
+	int outbox;
+
+	// 服务一次运行（resume）中最多处理的消息数量，为 1 时每条消息都让出一次。
+	int batch;
+
+	// 服务一次运行中处理消息的 CPU 时间预算（微秒），超出后即使还有消息也让出。0 表示不限制。
+	int batch_time;
+
+	// 为 1 时每个服务的 lua 虚拟机使用独立的内存池（arena），小对象从按尺寸分级的 slab 中分配，服务退出时整体释放。
+	int arena;
+
+	// 定时器的精度（微秒），即时间轮每一格的长度。必须能整除 10000（1/100 秒），默认 10000 。
+	int timer_resolution;
+
+	// 可以同时使用的套接字事件（sockevent）数量，每个调用 eventinit 的服务占用一个，默认 256 。
+	int sockevent;
+
+	// 为 1 时启动一个 I/O 线程（linux 下使用 epoll），服务可以等待 fd 可读写而不阻塞工作线程，就绪事件以消息的形式投递给服务。
+	int reactor;
+
+	// 执行阻塞调用（ltask.io 的文件读写，ltask.offload 的 C 函数）的线程数量，为 0 时不能使用它们。
+	int io_thread;
+
+	// 编译后代码块缓存的容量（字节，源代码和字节码），超出后淘汰最久未使用的。0 表示不缓存，默认 64M 。
+	int chunkcache;
+
 	// 表示支持的最大服务数。Ltask 使用“服务”来指代独立的 Lua 虚拟机实例，
 		// 每个实例都可以独立运行代码，因此 max_service 限制了可以并行运行的服务总数。
 	int max_service;
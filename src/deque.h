@@ -0,0 +1,88 @@
+#ifndef ltask_deque_h
+#define ltask_deque_h
+
+#include "atomic.h"
+
+// Work stealing deque of service id, after Chase-Lev.
+// Only the owner pushes at the bottom, the owner and the other workers take from the top (FIFO),
+// so a pair of services waking each other can't starve the older ones in the queue.
+
+#define DEQUE_SIZE 256
+
+struct deque {
+	// 拥有者和窃取者（其他工作线程）竞争的出队位置，用 CAS 推进。
+	CACHE_LINE_ALIGN atomic_int top;
+	// 只有拥有者线程修改的位置（入队）。
+	CACHE_LINE_ALIGN atomic_int bottom;
+	// 环形缓冲区，DEQUE_SIZE 必须是 2 的幂。
+	CACHE_LINE_ALIGN atomic_int q[DEQUE_SIZE];
+};
+
+// The counters wrap around, compare them as unsigned
+static inline int
+deque_diff_(int a, int b) {
+	return (int)((unsigned)a - (unsigned)b);
+}
+
+static inline int
+deque_add_(int a, int n) {
+	return (int)((unsigned)a + (unsigned)n);
+}
+
+static inline void
+deque_init(struct deque *d) {
+	atomic_int_init(&d->top, 0);
+	atomic_int_init(&d->bottom, 0);
+	int i;
+	for (i=0;i<DEQUE_SIZE;i++) {
+		atomic_int_init(&d->q[i], 0);
+	}
+}
+
+// Calling by owner. 0 : succ, 1 : full
+static inline int
+deque_push(struct deque *d, int v) {
+	int b = atomic_int_load(&d->bottom);
+	int t = atomic_int_load(&d->top);
+	if (deque_diff_(b, t) >= DEQUE_SIZE)
+		return 1;
+	atomic_int_store(&d->q[b & (DEQUE_SIZE - 1)], v);
+	atomic_int_store(&d->bottom, deque_add_(b, 1));
+	return 0;
+}
+
+// Calling by owner. returns 0 if empty
+static inline int
+deque_pop(struct deque *d) {
+	for (;;) {
+		int t = atomic_int_load(&d->top);
+		int b = atomic_int_load(&d->bottom);
+		if (deque_diff_(b, t) <= 0)
+			return 0;
+		int v = atomic_int_load(&d->q[t & (DEQUE_SIZE - 1)]);
+		// Race with the thieves, retry if lost
+		if (atomic_compare_exchange_strong(&d->top, &t, deque_add_(t, 1)))
+			return v;
+	}
+}
+
+// Calling by other threads. returns 0 if empty or lost the race
+static inline int
+deque_steal(struct deque *d) {
+	int t = atomic_int_load(&d->top);
+	int b = atomic_int_load(&d->bottom);
+	if (deque_diff_(b, t) <= 0)
+		return 0;
+	int v = atomic_int_load(&d->q[t & (DEQUE_SIZE - 1)]);
+	if (!atomic_compare_exchange_strong(&d->top, &t, deque_add_(t, 1)))
+		return 0;
+	return v;
+}
+
+static inline int
+deque_length(struct deque *d) {
+	int n = deque_diff_(atomic_int_load(&d->bottom), atomic_int_load(&d->top));
+	return n < 0 ? 0 : n;
+}
+
+#endif
@@ -0,0 +1,126 @@
+#include "fileio.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
+
+#include <io.h>
+
+#define open_(filename, flags) _open(filename, (flags) | _O_BINARY, _S_IREAD | _S_IWRITE)
+#define close_ _close
+#define fsync_ _commit
+
+// No pread/pwrite, seek first. The offset of the file is shared, don't mix them with the current position.
+static int64_t
+pread_(int fd, void *buf, size_t sz, int64_t offset) {
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _read(fd, buf, (unsigned int)sz);
+}
+
+static int64_t
+pwrite_(int fd, const void *buf, size_t sz, int64_t offset) {
+	if (_lseeki64(fd, offset, SEEK_SET) < 0)
+		return -1;
+	return _write(fd, buf, (unsigned int)sz);
+}
+
+#define read_(fd, buf, sz) _read(fd, buf, (unsigned int)(sz))
+#define write_(fd, buf, sz) _write(fd, buf, (unsigned int)(sz))
+
+#else
+
+#include <unistd.h>
+
+#define open_(filename, flags) open(filename, (flags) | O_CLOEXEC, 0666)
+#define close_ close
+#define fsync_ fsync
+#define pread_ pread
+#define pwrite_ pwrite
+#define read_ read
+#define write_ write
+
+#endif
+
+// The same as the mode of fopen
+static int
+open_flags(const char *mode) {
+	int flags;
+	switch (mode[0]) {
+	case 'r':
+		flags = 0;
+		break;
+	case 'w':
+		flags = O_CREAT | O_TRUNC;
+		break;
+	case 'a':
+		flags = O_CREAT | O_APPEND;
+		break;
+	default:
+		return -1;
+	}
+	int i;
+	int update = 0;
+	for (i=1;mode[i];i++) {
+		if (mode[i] == '+')
+			update = 1;
+		else if (mode[i] != 'b')
+			return -1;
+	}
+	if (update)
+		flags |= O_RDWR;
+	else
+		flags |= mode[0] == 'r' ? O_RDONLY : O_WRONLY;
+	return flags;
+}
+
+static inline int64_t
+result(int64_t r) {
+	return r < 0 ? -(int64_t)errno : r;
+}
+
+int64_t
+fileio_open(const char *filename, const char *mode) {
+	int flags = open_flags(mode);
+	if (flags < 0)
+		return -EINVAL;
+	return result(open_(filename, flags));
+}
+
+int64_t
+fileio_close(int fd) {
+	return result(close_(fd));
+}
+
+int64_t
+fileio_read(int fd, void *buf, size_t sz, int64_t offset) {
+	int64_t r;
+	do {
+		r = offset < 0 ? read_(fd, buf, sz) : pread_(fd, buf, sz, offset);
+	} while (r < 0 && errno == EINTR);
+	return result(r);
+}
+
+// Write all of buf unless an error occurs
+int64_t
+fileio_write(int fd, const void *buf, size_t sz, int64_t offset) {
+	const char *ptr = (const char *)buf;
+	size_t n = 0;
+	while (n < sz) {
+		int64_t r = offset < 0 ? write_(fd, ptr + n, sz - n) : pwrite_(fd, ptr + n, sz - n, offset + n);
+		if (r <= 0) {
+			if (r < 0 && errno == EINTR)
+				continue;
+			return n > 0 ? (int64_t)n : result(r);
+		}
+		n += r;
+	}
+	return (int64_t)n;
+}
+
+int64_t
+fileio_fsync(int fd) {
+	return result(fsync_(fd));
+}
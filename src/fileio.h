@@ -0,0 +1,17 @@
+#ifndef ltask_fileio_h
+#define ltask_fileio_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Blocking file operations for the I/O threads.
+// They return >= 0 if succ, or -errno .
+// offset < 0 means the current position of the file.
+
+int64_t fileio_open(const char *filename, const char *mode);
+int64_t fileio_close(int fd);
+int64_t fileio_read(int fd, void *buf, size_t sz, int64_t offset);
+int64_t fileio_write(int fd, const void *buf, size_t sz, int64_t offset);
+int64_t fileio_fsync(int fd);
+
+#endif
@@ -0,0 +1,81 @@
+#include "jobqueue.h"
+#include "spinlock.h"
+#include "cond.h"
+#include <stdlib.h>
+
+struct jobqueue {
+	struct spinlock lock;
+	// 空闲的线程睡眠在这里，添加任务时唤醒一个。
+	struct cond trigger;
+	// 先进先出的任务链表
+	struct job *head;
+	struct job *tail;
+};
+
+struct jobqueue *
+jobqueue_new() {
+	struct jobqueue *Q = (struct jobqueue *)malloc(sizeof(*Q));
+	if (Q == NULL)
+		return NULL;
+	spinlock_init(&Q->lock);
+	cond_create(&Q->trigger);
+	Q->head = NULL;
+	Q->tail = NULL;
+	return Q;
+}
+
+void
+jobqueue_delete(struct jobqueue *Q) {
+	if (Q == NULL)
+		return;
+	struct job *j = Q->head;
+	while (j) {
+		struct job *next = j->next;
+		free(j);
+		j = next;
+	}
+	cond_release(&Q->trigger);
+	spinlock_destroy(&Q->lock);
+	free(Q);
+}
+
+void
+jobqueue_push(struct jobqueue *Q, struct job *j) {
+	j->next = NULL;
+	spinlock_acquire(&Q->lock);
+	if (Q->tail) {
+		Q->tail->next = j;
+	} else {
+		Q->head = j;
+	}
+	Q->tail = j;
+	spinlock_release(&Q->lock);
+
+	cond_trigger_begin(&Q->trigger);
+	cond_trigger_end(&Q->trigger, 1);
+}
+
+static struct job *
+take_job(struct jobqueue *Q) {
+	spinlock_acquire(&Q->lock);
+	struct job *j = Q->head;
+	if (j) {
+		Q->head = j->next;
+		if (Q->head == NULL)
+			Q->tail = NULL;
+	}
+	spinlock_release(&Q->lock);
+	return j;
+}
+
+struct job *
+jobqueue_pop(struct jobqueue *Q, uint64_t usec) {
+	struct job *j = take_job(Q);
+	if (j)
+		return j;
+	// The trigger flag is set if a job is pushed after take_job()
+	cond_wait_begin(&Q->trigger);
+	cond_timedwait(&Q->trigger, usec);
+	cond_wait_end(&Q->trigger);
+	return take_job(Q);
+}
@@ -0,0 +1,23 @@
+#ifndef ltask_jobqueue_h
+#define ltask_jobqueue_h
+
+#include <stdint.h>
+
+// The jobs running in a pool of threads outside the scheduler (blocking calls).
+
+struct job {
+	struct job *next;
+	// Runs in a pool thread, it should free the job (allocated by malloc)
+	void (*func)(struct job *j);
+};
+
+struct jobqueue;
+
+struct jobqueue * jobqueue_new();
+// Free the jobs not taken
+void jobqueue_delete(struct jobqueue *Q);
+void jobqueue_push(struct jobqueue *Q, struct job *j);
+// Take a job, wait no more than usec (1/1000000s) if it's empty. returns NULL if timeout
+struct job * jobqueue_pop(struct jobqueue *Q, uint64_t usec);
+
+#endif
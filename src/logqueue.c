@@ -1,5 +1,6 @@
 #include "logqueue.h"
 #include "spinlock.h"
+#include "message.h"
 #include <stdlib.h>
 
 struct log_item {
@@ -40,7 +41,7 @@ void
 logqueue_delete(struct logqueue *q) {
 	struct logmessage m;
 	while (!logqueue_pop(q, &m)) {
-		free(m.msg);
+		message_payload_delete(m.msg);
 	}
 	spinlock_destroy(&q->lock);
 	free_items(q->freelist);
@@ -11,6 +11,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
+#include <limits.h>
 
 #include "atomic.h"
 #include "queue.h"
@@ -21,6 +22,12 @@
 #include "message.h"
 #include "lua-seri.h"
 #include "timer.h"
+#include "reactor.h"
+#include "jobqueue.h"
+#include "fileio.h"
+#include "offload.h"
+#include "mailbox.h"
+#include "chunkcache.h"
 #include "sysapi.h"
 #include "debuglog.h"
 #include "logqueue.h"
@@ -50,6 +57,10 @@ LUAMOD_API int luaopen_ltask_root(lua_State *L);
 #endif
 
 
+#if MAX_WORKER > BITMAP_BITS
+#error "BITMAP_BITS should be large enough for MAX_WORKER"
+#endif
+
 /*
 	struct ltask 是 一个用于多线程任务调度和管理的结构体，包含了各种配置、线程管理、事件、服务池、消息队列、日志、定时器等。
 */
@@ -60,12 +71,15 @@ struct ltask {
 	// 指向工作线程的指针数组，管理和调度任务的工作线程
 	struct worker_thread *workers;		
 
+	// 工作线程的状态位图，调度器每一步只遍历状态改变的线程。和 workers 分配在一起，按 CACHE_LINE_SIZE 对齐。
+	struct worker_map *map;
+
 	// 使用 atomic_int 类型的数组表示初始化状态的事件，保证在多线程环境下的原子操作，以确保线程安全。
-	//	MAX_SOCKEVENT 表示可以处理的最大套接字事件数, 默认为16
-	atomic_int event_init[MAX_SOCKEVENT];
+	//	数组长度为 config->sockevent ，表示可以处理的最大套接字事件数, 默认为256
+	atomic_int *event_init;
 	
 	// sockevent数组，存储事件通知机制的相关信息，允许多线程间有效通信
-	struct sockevent event[MAX_SOCKEVENT];
+	struct sockevent *event;
 
 	// 指向服务池的指针，管理正在运行的服务及其状态，以便有效调度和管理服务
 	struct service_pool *services;
@@ -76,6 +90,18 @@ struct ltask {
 	// 指向定时器的指针，用于处理定时任务和超时管理，允许服务定时执行或超时。
 	struct timer *timer;
 
+	// 定时器线程睡眠在这里，添加了更早到期的定时器时唤醒它。
+	struct cond timer_trigger;
+
+	// 定时器线程运行时为 1 ，timer_add 需要时唤醒它。
+	int timer_thread;
+
+	// 配置了 reactor 时，I/O 线程在这里等待服务注册的 fd 就绪，否则为 NULL 。
+	struct reactor *reactor;
+
+	// 配置了 io_thread 时，交给线程池执行的阻塞任务（ltask.io, ltask.offload）队列，否则为 NULL 。
+	struct jobqueue *jobs;
+
 	// 指向调试日志记录器的指针，仅在启用调试模式下使用，用于捕捉系统运行时的调试信息。
 #ifdef DEBUGLOG
 	struct debug_logger *logger;
@@ -121,6 +147,9 @@ struct service_ud {
 	service_id id;
 };
 
+// The worker of current thread, NULL if it's not a worker thread
+static THREAD_LOCAL struct worker_thread *current_worker = NULL;
+
 static int
 get_worker_id(struct ltask *task, service_id id) {
 	int total_worker = task->config->worker;
@@ -141,12 +170,21 @@ schedule_back(struct ltask *task, service_id id) {
 	assert(r == 0);
 }
 
+static inline void
+write_receipt(struct service_pool *P, service_id id, int wait, int receipt, struct message *bounce) {
+	if (wait) {
+		service_write_receipt(P, id, receipt, bounce);
+	} else if (receipt != MESSAGE_RECEIPT_DONE) {
+		service_write_bounce(P, id, receipt, bounce);
+	}
+}
+
 static void
-dispatch_schedule_message(struct ltask *task, service_id id, struct message *msg) {
+dispatch_schedule_message(struct ltask *task, service_id id, struct message *msg, int wait) {
 	struct service_pool *P = task->services;
 	if (id.id != SERVICE_ID_ROOT) {
 		// only root can send schedule message
-		service_write_receipt(P, id, MESSAGE_RECEIPT_ERROR, msg);
+		write_receipt(P, id, wait, MESSAGE_RECEIPT_ERROR, msg);
 		return;
 	}
 
@@ -156,33 +194,63 @@ dispatch_schedule_message(struct ltask *task, service_id id, struct message *msg
 		msg->to = service_new(P, sid.id);
 		debug_printf(task->logger, "New service %x", msg->to.id);
 		if (msg->to.id == 0) {
-			service_write_receipt(P, id, MESSAGE_RECEIPT_ERROR, msg);
+			write_receipt(P, id, wait, MESSAGE_RECEIPT_ERROR, msg);
 		} else {
-			service_write_receipt(P, id, MESSAGE_RECEIPT_RESPONCE, msg);
+			write_receipt(P, id, wait, MESSAGE_RECEIPT_RESPONCE, msg);
 		}
 		break;
 	case MESSAGE_SCHEDULE_DEL:
 		debug_printf(task->logger, "Delete service %x", sid.id);
 		service_delete(P, sid);
 		message_delete(msg);
-		service_write_receipt(P, id, MESSAGE_RECEIPT_DONE, NULL);
+		write_receipt(P, id, wait, MESSAGE_RECEIPT_DONE, NULL);
 		break;
 	default:
-		service_write_receipt(P, id, MESSAGE_RECEIPT_ERROR, msg);
+		write_receipt(P, id, wait, MESSAGE_RECEIPT_ERROR, msg);
 		break;
 	}
 }
 
+// Wake up a sleeping worker to steal the jobs in local queues
+static void
+wakeup_idle_worker(struct ltask *task) {
+	const int worker_n = task->config->worker;
+	if (atomic_int_load(&task->active_worker) >= worker_n)
+		return;
+	int i;
+	for (i=0;i<worker_n;i++) {
+		struct worker_thread * w = &task->workers[i];
+		if (w->sleeping && w->binding.id == 0 && worker_wakeup(w))
+			return;
+	}
+}
+
+// Called by the worker which doesn't own the schedule, so no debug log here.
+static void
+wakeup_service(struct ltask *task, service_id to) {
+	int sockid;
+	if (service_wakeup(task->services, to, &sockid)) {
+		struct worker_thread * w = current_worker;
+		// The binding services go through the scheduler
+		if (w && w->binding.id == 0 && service_binding_get(task->services, to) < 0
+			&& worker_push_local(w, to) == 0) {
+			wakeup_idle_worker(task);
+		} else {
+			schedule_back(task, to);
+		}
+	} else if (sockid >= 0) {
+		sockevent_trigger(&task->event[sockid]);
+	}
+}
+
 static void
 check_message_to(struct ltask *task, service_id to) {
-	struct service_pool *P = task->services;
-	int status = service_status_get(P, to);
-	if (status == SERVICE_STATUS_IDLE) {
+	int sockid;
+	// Any worker may call it, only the one switches IDLE to SCHEDULE puts it back to schedule queue.
+	if (service_wakeup(task->services, to, &sockid)) {
 		debug_printf(task->logger, "Service %x is in schedule", to.id);
-		service_status_set(P, to, SERVICE_STATUS_SCHEDULE);
 		schedule_back(task, to);
 	} else {
-		int sockid = service_sockevent_get(task->services, to);
 		if (sockid >= 0) {
 			debug_printf(task->logger, "Trigger sockevent of service %d", to.id);
 			sockevent_trigger(&task->event[sockid]);
@@ -191,25 +259,26 @@ check_message_to(struct ltask *task, service_id to) {
 }
 
 static void
-dispatch_out_message(struct ltask *task, service_id id, struct message *msg) {
+dispatch_out_message(struct ltask *task, service_id id, struct message *msg, int wait) {
 	debug_printf(task->logger, "Message from %d to %d type=%d", id.id, msg->to.id, msg->type);
 	struct service_pool *P = task->services;
 	if (msg->to.id == SERVICE_ID_SYSTEM) {
-		dispatch_schedule_message(task, id, msg);
+		dispatch_schedule_message(task, id, msg, wait);
 	} else {
-		switch (service_push_message(P, msg->to, msg)) {
+		service_id to = msg->to;
+		switch (service_push_message(P, to, msg)) {
 		case 0 :
 			// succ
-			service_write_receipt(P, id, MESSAGE_RECEIPT_DONE, NULL);
+			write_receipt(P, id, wait, MESSAGE_RECEIPT_DONE, NULL);
 			break;
 		case 1 :
-			service_write_receipt(P, id, MESSAGE_RECEIPT_BLOCK, msg);
+			write_receipt(P, id, wait, MESSAGE_RECEIPT_BLOCK, msg);
 			break;
 		default :	// (Dead) -1
-			service_write_receipt(P, id, MESSAGE_RECEIPT_ERROR, msg);
+			write_receipt(P, id, wait, MESSAGE_RECEIPT_ERROR, msg);
 			break;
 		}
-		check_message_to(task, msg->to);
+		check_message_to(task, to);
 	}
 }
 
@@ -217,13 +286,16 @@ static int
 collect_done_job(struct ltask *task, service_id done_job[]) {
 	int done_job_n = 0;
 	int i;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
-		struct worker_thread * w = &task->workers[i];
-		service_id job = worker_done_job(w);
-		if (job.id) {
-			debug_printf(task->logger, "Service %x is done", job.id);
-			done_job[done_job_n++] = job;
+	const int words = bitmap_words(task->config->worker);
+	for (i=0;i<words;i++) {
+		uint64_t bits = bitmap_take(&task->map->done, i);
+		while (bits) {
+			struct worker_thread * w = &task->workers[i * 64 + bitmap_pop(&bits)];
+			service_id job = worker_done_job(w);
+			if (job.id) {
+				debug_printf(task->logger, "Service %x is done", job.id);
+				done_job[done_job_n++] = job;
+			}
 		}
 	}
 	return done_job_n;
@@ -237,28 +309,35 @@ dispath_out_messages(struct ltask *task, const service_id done_job[], int done_j
 	for (i=0;i<done_job_n;i++) {
 		service_id id = done_job[i];
 		int status = service_status_get(P, id);
+		int wait;
+		struct message *msg;
 		if (status == SERVICE_STATUS_DEAD) {
-			struct message *msg = service_message_out(P, id);
+			// flush the outbox, the signal to root is the last one
+			while ((msg = service_message_out(P, id, &wait)) && msg->type != MESSAGE_SIGNAL) {
+				dispatch_out_message(task, id, msg, 0);
+			}
 			assert(msg && msg->to.id == SERVICE_ID_ROOT && msg->type == MESSAGE_SIGNAL);
-			switch (service_push_message(P, msg->to, msg)) {
+			service_id root = msg->to;
+			switch (service_push_message(P, root, msg)) {
 			case 0 :
 				// succ
 				debug_printf(task->logger, "Signal %x dead to root", id.id);
-				check_message_to(task, msg->to);
+				check_message_to(task, root);
 				break;
 			case 1 :
 				debug_printf(task->logger, "Root service is blocked, Service %x tries to signal it later", id.id);
+				service_send_message(P, id, msg, 0);
 				schedule_back(task, id);
 				break;
 			default:
 				debug_printf(task->logger, "Root service is missing");
+				message_delete(msg);
 				service_delete(P, id);
 				break;
 			}
 		} else {
-			struct message *msg = service_message_out(P, id);
-			if (msg) {
-				dispatch_out_message(task, id, msg);
+			while ((msg = service_message_out(P, id, &wait))) {
+				dispatch_out_message(task, id, msg, wait);
 			}
 			assert(status == SERVICE_STATUS_DONE);
 			if (!service_has_message(P, id)) {
@@ -278,6 +357,9 @@ dispath_out_messages(struct ltask *task, const service_id done_job[], int done_j
 				} else {
 					debug_printf(task->logger, "Service %x is idle", id.id);
 					service_status_set(P, id, SERVICE_STATUS_IDLE);
+					// Other workers may push messages before it becomes IDLE, check again.
+					if (service_has_message(P, id))
+						check_message_to(task, id);
 				}
 			} else {
 				debug_printf(task->logger, "Service %x back to schedule", id.id);
@@ -292,16 +374,21 @@ static inline void
 kick_running(struct worker_thread * w, service_id id) {
 	w->task->blocked_service = 1;
 	w->waiting = id;	// will kick running later
+	bitmap_set(&w->map->waiting, w->worker_id);
 }
 
 static int
 count_freeslot(struct ltask *task) {
-	int i;
 	int free_slot = 0;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
-		struct worker_thread * w = &task->workers[i];
-		if (w->service_ready == 0) {
+	const int words = bitmap_words(task->config->worker);
+	int word;
+	for (word=0;word<words;word++) {
+		uint64_t bits = bitmap_word(&task->map->free, word);
+		while (bits) {
+			int i = word * 64 + bitmap_pop(&bits);
+			struct worker_thread * w = &task->workers[i];
+			if (w->service_ready != 0)
+				continue;
 			struct binding_service * q = &(w->binding_queue);
 			if (q->tail == q->head) {
 				if (!worker_has_job(w)) {
@@ -312,7 +399,7 @@ count_freeslot(struct ltask *task) {
 				++q->head;
 				if (q->head == q->tail)
 					q->head = q->tail = 0;
-				atomic_int_store(&w->service_ready, id.id);
+				worker_set_ready(w, id);
 				kick_running(w, id);
 				worker_wakeup(w);
 				debug_printf(task->logger, "Assign queue %x to worker %d", id.id, i);
@@ -357,23 +444,31 @@ static void
 trigger_blocked_workers(struct ltask *task) {
 	if (!task->blocked_service)
 		return;
-	int i;
 	int blocked = 0;
-	const int worker_n = task->config->worker;
-	for (i=0;i<worker_n;i++) {
-		struct worker_thread * w = &task->workers[i];
-		if (w->waiting.id != 0) {
-			service_id running = w->running;
-			if (running.id != 0) {
-				// touch service who block the waiting service
-				int sockevent_id = service_sockevent_get(task->services, running);
-				if (sockevent_id >= 0) {
-					sockevent_trigger(&task->event[sockevent_id]);
+	const int words = bitmap_words(task->config->worker);
+	int word;
+	for (word=0;word<words;word++) {
+		uint64_t bits = bitmap_word(&task->map->waiting, word);
+		while (bits) {
+			int i = word * 64 + bitmap_pop(&bits);
+			struct worker_thread * w = &task->workers[i];
+			if (w->waiting.id != 0) {
+				service_id running = w->running;
+				if (running.id != 0) {
+					// touch service who block the waiting service
+					int sockevent_id = service_sockevent_get(task->services, running);
+					if (sockevent_id >= 0) {
+						sockevent_trigger(&task->event[sockevent_id]);
+					}
+					w->waiting.id = 0;
+					bitmap_clear(&task->map->waiting, i);
+				} else {
+					// continue waiting for blocked service running
+					blocked = 1;
 				}
-				w->waiting.id = 0;
 			} else {
-				// continue waiting for blocked service running
-				blocked = 1;
+				// the worker runs the waiting service already
+				bitmap_clear(&task->map->waiting, i);
 			}
 		}
 	}
@@ -391,6 +486,8 @@ assign_prepare_task(struct ltask *task, const service_id prepare[], int prepare_
 	for (i=0;i<prepare_n;i++) {
 		service_id id = prepare[i];
 		for (;;) {
+			// Only the free workers (service_ready == 0) can accept a job
+			worker_id = bitmap_find(&task->map->free, worker_id, worker_n);
 			if (worker_id >= worker_n) {
 				if (use_busy == 0) {
 					use_busy = 1;
@@ -400,6 +497,7 @@ assign_prepare_task(struct ltask *task, const service_id prepare[], int prepare_
 					use_binding = 1;
 					worker_id = 0;
 				}
+				continue;
 			}
 			struct worker_thread * w = &task->workers[worker_id++];
 			if ((use_busy || !w->busy) && (w->binding.id == 0 || use_binding)) {
@@ -417,18 +515,25 @@ assign_prepare_task(struct ltask *task, const service_id prepare[], int prepare_
 	}
 }
 
+// The busy workers with a ready job, they are not in the free bitmap.
 static int
 get_pending_jobs(struct ltask *task, service_id output[]) {
-	int i;
-	int worker_n = task->config->worker;
+	const int worker_n = task->config->worker;
+	const int words = bitmap_words(worker_n);
+	int word;
 	int n = 0;
 	struct service_pool * P = task->services;
-	for (i=0;i<worker_n;i++) {
-		struct worker_thread * w = &task->workers[i];
-		if (w->busy) {
-			service_id id = worker_steal_job(w, P);
-			if (id.id) {
-				output[n++] = id;
+	for (word=0;word<words;word++) {
+		uint64_t bits = ~bitmap_word(&task->map->free, word);
+		if (word == words - 1 && worker_n % 64)
+			bits &= ((uint64_t)1 << (worker_n % 64)) - 1;
+		while (bits) {
+			struct worker_thread * w = &task->workers[word * 64 + bitmap_pop(&bits)];
+			if (w->busy) {
+				service_id id = worker_steal_job(w, P);
+				if (id.id) {
+					output[n++] = id;
+				}
 			}
 		}
 	}
@@ -553,6 +658,54 @@ steal_job(struct worker_thread * worker) {
 	return fail;
 }
 
+static service_id
+steal_local_job(struct worker_thread * worker) {
+	const int worker_n = worker->task->config->worker;
+	int i;
+	for (i=1;i<worker_n;i++) {
+		struct worker_thread * w = &worker->task->workers[(worker->worker_id + i) % worker_n];
+		service_id job = worker_steal_local(w);
+		if (job.id)
+			return job;
+	}
+	service_id fail = { 0 };
+	return fail;
+}
+
+#define LOCAL_BATCH 16
+
+// Get a job from local queue, or steal one from others, without waiting for the scheduler
+static service_id
+get_local_job(struct worker_thread * worker) {
+	if (worker->local_batch >= LOCAL_BATCH) {
+		// Move the local jobs back to the schedule queue, behind the services waiting there.
+		worker->local_batch = 0;
+		service_id id;
+		while ((id = worker_pop_local(worker)).id) {
+			schedule_back(worker->task, id);
+		}
+		return id;
+	}
+	service_id job = worker_pop_local(worker);
+	if (job.id == 0) {
+		if (worker->binding.id) {
+			// bind a service, don't steal
+			return job;
+		}
+		job = steal_local_job(worker);
+		if (job.id == 0)
+			return job;
+		debug_printf(worker->logger, "Steal local service %x", job.id);
+	}
+	++worker->local_batch;
+	// Dispatch the done jobs only if nobody owns the scheduler
+	if (!acquire_scheduler(worker)) {
+		schedule_dispatch(worker->task);
+		release_scheduler(worker);
+	}
+	return job;
+}
+
 // 1 : no job
 static int
 schedule_dispatch_worker(struct worker_thread *worker) {
@@ -567,7 +720,7 @@ schedule_dispatch_worker(struct worker_thread *worker) {
 			service_id job = steal_job(worker);
 			if (job.id) {
 				debug_printf(worker->logger, "Steal service %x", job.id);
-				atomic_int_store(&worker->service_ready, job.id);
+				worker_set_ready(worker, job);
 			} else {
 				// steal fail
 				return 1;
@@ -597,7 +750,7 @@ quit_all_workers(struct ltask *task) {
 static void
 trigger_all_sockevent(struct ltask *task) {
 	int i;
-	for (i=0;i<MAX_SOCKEVENT;i++) {
+	for (i=0;i<task->config->sockevent;i++) {
 		sockevent_trigger(&task->event[i]);
 	}
 }
@@ -666,6 +819,7 @@ static void
 thread_worker(void *ud) {
 	struct worker_thread * w = (struct worker_thread *)ud;
 	struct service_pool * P = w->task->services;
+	current_worker = w;
 	atomic_int_inc(&w->task->active_worker);
 	thread_setnamef("ltask!worker-%02d", w->worker_id);
 
@@ -679,9 +833,13 @@ thread_worker(void *ud) {
 			break;
 		}
 		service_id id = worker_get_job(w);
+		if (id.id == 0)
+			id = get_local_job(w);
+		else
+			w->local_batch = 0;
 		int dead = 0;
 		if (id.id) {
-			w->busy = 1;
+			worker_set_busy(w, 1);
 			w->running = id;
 			if (w->waiting.id == id.id) {
 				w->waiting.id = 0;
@@ -711,7 +869,7 @@ thread_worker(void *ud) {
 			} else {
 				debug_printf(w->logger, "Service %x is dead", id.id);
 			}
-			w->busy = 0;
+			worker_set_busy(w, 0);
 
 			// check binding
 
@@ -757,10 +915,18 @@ thread_worker(void *ud) {
 		}
 	}
 	worker_quit(w);
+	message_cache_flush();
 	atomic_int_dec(&w->task->thread_count);
 	debug_printf(w->logger, "Quit");
 }
 
+// Push a userdata, and returns the address aligned to CACHE_LINE_SIZE
+static void *
+aligned_userdata(lua_State *L, size_t sz) {
+	uintptr_t ptr = (uintptr_t)lua_newuserdatauv(L, sz + CACHE_LINE_SIZE - 1, 0);
+	return (void *)((ptr + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+}
+
 static int
 ltask_init(lua_State *L) {
 	if (lua_getfield(L, LUA_REGISTRYINDEX, "LTASK_CONFIG") != LUA_TNIL) {
@@ -781,16 +947,36 @@ ltask_init(lua_State *L) {
 	struct ltask *task = (struct ltask *)lua_newuserdatauv(L, sizeof(*task), 0);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_GLOBAL");
 
+	message_pool_init();
+	chunkcache_init(config->chunkcache);
 	task->lqueue = logqueue_new();
 #ifdef DEBUGLOG
 	task->logger = dlog_new("SCHEDULE", -1);
 #endif
 	task->config = config;
-	task->workers = (struct worker_thread *)lua_newuserdatauv(L, config->worker * sizeof(struct worker_thread), 0);
+	// sizeof(struct worker_thread) is a multiple of CACHE_LINE_SIZE, so the map after the workers is aligned too
+	task->workers = (struct worker_thread *)aligned_userdata(L, config->worker * sizeof(struct worker_thread) + sizeof(struct worker_map));
+	task->map = (struct worker_map *)(task->workers + config->worker);
+	worker_map_init(task->map);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_WORKERS");
+	task->event = (struct sockevent *)lua_newuserdatauv(L, config->sockevent * (sizeof(struct sockevent) + sizeof(atomic_int)), 0);
+	task->event_init = (atomic_int *)(task->event + config->sockevent);
+	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_SOCKEVENTS");
 	task->services = service_create(config);
-	task->schedule = queue_new_int(config->max_service);
+	task->schedule = queue_new_mpsc_int(config->max_service);
 	task->timer = NULL;
+	task->reactor = NULL;
+	if (config->reactor) {
+		task->reactor = reactor_new();
+		if (task->reactor == NULL)
+			return luaL_error(L, "Reactor is not supported");
+	}
+	task->jobs = NULL;
+	if (config->io_thread > 0) {
+		task->jobs = jobqueue_new();
+	}
+	cond_create(&task->timer_trigger);
+	task->timer_thread = 0;
 	task->external_message = NULL;
 	task->external_last_message = NULL;
 	if (config->external_queue) {
@@ -815,14 +1001,14 @@ ltask_init(lua_State *L) {
 
 	int i;
 	for (i=0;i<config->worker;i++) {
-		worker_init(&task->workers[i], task, i);
+		worker_init(&task->workers[i], task, task->map, i);
 	}
 
 	atomic_int_init(&task->schedule_owner, THREAD_NONE);
 	atomic_int_init(&task->active_worker, 0);
 	atomic_int_init(&task->thread_count, 0);
 
-	for (i=0;i<MAX_SOCKEVENT;i++) {
+	for (i=0;i<task->config->sockevent;i++) {
 		sockevent_init(&task->event[i]);
 		atomic_int_init(&task->event_init[i], 0);
 	}
@@ -878,6 +1064,398 @@ thread_logger(void *ud) {
 	}
 }
 
+struct timer_event {
+	session_t session;
+	service_id id;
+};
+
+// Wakeup a worker to run the scheduler, for the threads other than workers.
+static void
+wakeup_scheduler(struct ltask *task) {
+	const int worker_n = task->config->worker;
+	int i;
+	for (i=0;i<worker_n;i++) {
+		struct worker_thread * w = &task->workers[i];
+		if (w->sleeping && worker_wakeup(w))
+			return;
+	}
+	// No one is sleeping now, but the last one may be going to sleep
+	worker_wakeup(&task->workers[0]);
+}
+
+struct timer_expired {
+	struct timer_event ev;
+	int seq;
+};
+
+// The messages blocked by full mailbox, or the expired timers to send
+struct timer_list {
+	int n;
+	int cap;
+	union {
+		struct message **msg;
+		struct timer_expired *ex;
+		void *ptr;
+	} u;
+};
+
+static int
+timer_list_reserve(struct timer_list *l, size_t sz) {
+	if (l->n < l->cap)
+		return 0;
+	int cap = l->cap ? l->cap * 2 : 64;
+	void *tmp = realloc(l->u.ptr, cap * sz);
+	if (tmp == NULL)
+		return 1;
+	l->u.ptr = tmp;
+	l->cap = cap;
+	return 0;
+}
+
+// Max sessions in one MESSAGE_TIMER
+#define TIMER_BATCH 64
+
+// 0 : succ (or dead), 1 : block
+static int
+timer_send(struct ltask *task, struct message *msg) {
+	service_id to = msg->to;
+	int r = service_push_message(task->services, to, msg);
+	if (r == 1)
+		return 1;
+	if (r == 0) {
+		wakeup_service(task, to);
+	} else {
+		// dead service, drop it
+		message_delete(msg);
+	}
+	return 0;
+}
+
+static void
+timer_block(struct timer_list *blocked, struct message *msg) {
+	if (timer_list_reserve(blocked, sizeof(struct message *))) {
+		// out of memory, drop it
+		message_delete(msg);
+		return;
+	}
+	blocked->u.msg[blocked->n++] = msg;
+}
+
+// Retry the messages blocked by full mailbox, returns the number sent.
+static int
+timer_retry(struct ltask *task, struct timer_list *blocked) {
+	int i, n = 0;
+	for (i=0;i<blocked->n;i++) {
+		struct message *msg = blocked->u.msg[i];
+		if (timer_send(task, msg))
+			blocked->u.msg[n++] = msg;
+	}
+	int send = blocked->n - n;
+	blocked->n = n;
+	return send;
+}
+
+static void
+timer_collect(void *ud, void *arg) {
+	struct timer_list *expired = (struct timer_list *)ud;
+	if (timer_list_reserve(expired, sizeof(struct timer_expired)))
+		return;	// out of memory, drop it
+	struct timer_expired *ex = &expired->u.ex[expired->n];
+	ex->ev = *(struct timer_event *)arg;
+	ex->seq = expired->n++;
+}
+
+static int
+timer_expired_cmp(const void *a, const void *b) {
+	const struct timer_expired *ea = (const struct timer_expired *)a;
+	const struct timer_expired *eb = (const struct timer_expired *)b;
+	if (ea->ev.id.id != eb->ev.id.id)
+		return ea->ev.id.id < eb->ev.id.id ? -1 : 1;
+	// keep the order of expiry
+	return ea->seq - eb->seq;
+}
+
+// One message for a group of expired timers of the same service
+static struct message *
+timer_message(struct timer_expired *ex, int n) {
+	struct message m;
+	m.from.id = SERVICE_ID_SYSTEM;
+	m.to = ex->ev.id;
+	if (n == 1) {
+		m.session = ex->ev.session;
+		m.type = MESSAGE_RESPONSE;
+		m.msg = NULL;
+		m.sz = 0;
+	} else {
+		uint8_t *p = (uint8_t *)message_payload_new(n * sizeof(session_t));
+		if (p == NULL)
+			return NULL;
+		int i;
+		for (i=0;i<n;i++) {
+			memcpy(p + sizeof(uint32_t) + i * sizeof(session_t), &ex[i].ev.session, sizeof(session_t));
+		}
+		m.session = 0;
+		m.type = MESSAGE_TIMER;
+		m.msg = p;
+		m.sz = n;
+	}
+	struct message *msg = message_new(&m);
+	if (msg == NULL)
+		message_payload_delete(m.msg);
+	return msg;
+}
+
+// Send the expired timers grouped by service, returns the number of messages sent.
+static int
+timer_dispatch(struct ltask *task, struct timer_list *expired, struct timer_list *blocked) {
+	struct timer_expired *ex = expired->u.ex;
+	int n = expired->n;
+	expired->n = 0;
+	if (n > 1)
+		qsort(ex, n, sizeof(*ex), timer_expired_cmp);
+	int send = 0;
+	int i = 0;
+	while (i < n) {
+		int j = i + 1;
+		while (j < n && j - i < TIMER_BATCH && ex[j].ev.id.id == ex[i].ev.id.id)
+			++j;
+		struct message *msg = timer_message(&ex[i], j - i);
+		if (msg) {
+			if (timer_send(task, msg))
+				timer_block(blocked, msg);
+			else
+				++send;
+		}
+		i = j;
+	}
+	return send;
+}
+
+#define TIMER_MAXWAIT 100000	// 0.1s, check quit
+#define TIMER_RETRYWAIT 1000	// 1ms
+
+static void
+thread_timer(void *ud) {
+	struct ltask *task = (struct ltask *)ud;
+	struct timer *T = task->timer;
+	thread_setname("ltask!timer");
+	struct timer_list expired = { 0, 0, { NULL } };
+	struct timer_list blocked = { 0, 0, { NULL } };
+	while (atomic_int_load(&task->thread_count) > 0) {
+		int send = timer_retry(task, &blocked);
+		timer_update(T, timer_collect, &expired);
+		send += timer_dispatch(task, &expired, &blocked);
+		if (send > 0)
+			wakeup_scheduler(task);
+		uint64_t t = timer_wait_time(T, blocked.n ? TIMER_RETRYWAIT : TIMER_MAXWAIT);
+		if (t > 0) {
+			cond_wait_begin(&task->timer_trigger);
+			cond_timedwait(&task->timer_trigger, t);
+			cond_wait_end(&task->timer_trigger);
+		}
+	}
+	int i;
+	for (i=0;i<blocked.n;i++) {
+		message_delete(blocked.u.msg[i]);
+	}
+	free(blocked.u.ptr);
+	free(expired.u.ptr);
+	message_cache_flush();
+}
+
+static void
+timer_thread_trigger(struct ltask *task) {
+	cond_trigger_begin(&task->timer_trigger);
+	cond_trigger_end(&task->timer_trigger, 1);
+}
+
+#define REACTOR_BATCH 64
+#define REACTOR_MAXWAIT 100	// 0.1s, check quit
+#define REACTOR_RETRYWAIT 1	// 1ms
+
+// The ready events are sent as a response without payload, sz is the events.
+static struct message *
+reactor_message(struct reactor_event *ev) {
+	struct message m;
+	m.from.id = SERVICE_ID_SYSTEM;
+	m.to.id = ev->service;
+	m.session = ev->session;
+	m.type = MESSAGE_RESPONSE;
+	m.msg = NULL;
+	m.sz = ev->events;
+	return message_new(&m);
+}
+
+// The messages blocked by full mailbox are retried like the timer thread.
+static void
+thread_reactor(void *ud) {
+	struct ltask *task = (struct ltask *)ud;
+	struct reactor *R = task->reactor;
+	thread_setname("ltask!reactor");
+	struct reactor_event ev[REACTOR_BATCH];
+	struct timer_list blocked = { 0, 0, { NULL } };
+	while (atomic_int_load(&task->thread_count) > 0) {
+		int send = timer_retry(task, &blocked);
+		int n = reactor_wait(R, ev, REACTOR_BATCH, blocked.n ? REACTOR_RETRYWAIT : REACTOR_MAXWAIT);
+		int i;
+		for (i=0;i<n;i++) {
+			struct message *msg = reactor_message(&ev[i]);
+			if (msg == NULL)
+				continue;
+			if (timer_send(task, msg))
+				timer_block(&blocked, msg);
+			else
+				++send;
+		}
+		if (send > 0)
+			wakeup_scheduler(task);
+	}
+	int i;
+	for (i=0;i<blocked.n;i++) {
+		message_delete(blocked.u.msg[i]);
+	}
+	free(blocked.u.ptr);
+	message_cache_flush();
+}
+
+#define JOB_MAXWAIT 100000	// 0.1s, check quit
+
+// Send a message which must arrive (the result of a job, or MESSAGE_UNBLOCK). It's parked in the target
+// if the mailbox is full, and never blocked.
+static void
+park_message(struct ltask *task, struct message *msg) {
+	service_id to = msg->to;
+	service_id system = { SERVICE_ID_SYSTEM };
+	int r;
+	while ((r = service_park_message(task->services, to, msg, system)) == -2) {
+		// out of memory, wait for others to free some
+		sys_yield();
+	}
+	if (r < 0) {
+		// dead service, drop it
+		message_delete(msg);
+		return;
+	}
+	wakeup_service(task, to);
+	wakeup_scheduler(task);
+}
+
+// The response of a job is allocated when it's submitted, so the session is always woken up.
+static struct message *
+job_message(const struct service_ud *S, session_t session) {
+	struct message m;
+	m.from.id = SERVICE_ID_SYSTEM;
+	m.to = S->id;
+	m.session = session;
+	m.type = MESSAGE_RESPONSE;
+	m.msg = NULL;
+	m.sz = 0;
+	return message_new(&m);
+}
+
+static void
+thread_job(void *ud) {
+	struct ltask *task = (struct ltask *)ud;
+	thread_setname("ltask!job");
+	while (atomic_int_load(&task->thread_count) > 0) {
+		struct job *j = jobqueue_pop(task->jobs, JOB_MAXWAIT);
+		if (j)
+			j->func(j);
+	}
+	message_cache_flush();
+}
+
+#define IO_OPEN 0
+#define IO_CLOSE 1
+#define IO_READ 2
+#define IO_WRITE 3
+#define IO_FSYNC 4
+
+static const char * const io_ops[] = { "open", "close", "read", "write", "fsync", NULL };
+
+struct io_job {
+	struct job j;
+	struct ltask *task;
+	// the response, see job_message()
+	struct message *resp;
+	int op;
+	int fd;
+	// < 0 : the current position
+	int64_t offset;
+	size_t sz;
+	// filename and mode for open, or the data to write
+	char data[1];
+};
+
+// The payload of the response : int64 result (or -errno), int op, and the data read
+#define IO_RESULT (sizeof(int64_t) + sizeof(int))
+
+static void
+io_execute(struct job *j) {
+	struct io_job *job = (struct io_job *)j;
+	size_t sz = IO_RESULT + (job->op == IO_READ ? job->sz : 0);
+	uint8_t *p = (uint8_t *)message_payload_new(sz);
+	if (p == NULL) {
+		// out of memory, respond an error without payload
+		job->resp->type = MESSAGE_ERROR;
+		park_message(job->task, job->resp);
+		free(job);
+		return;
+	}
+	uint8_t *result = p + sizeof(uint32_t);
+	int64_t r;
+	switch (job->op) {
+	case IO_OPEN:
+		r = fileio_open(job->data, job->data + strlen(job->data) + 1);
+		break;
+	case IO_CLOSE:
+		r = fileio_close(job->fd);
+		break;
+	case IO_READ:
+		r = fileio_read(job->fd, result + IO_RESULT, job->sz, job->offset);
+		break;
+	case IO_WRITE:
+		r = fileio_write(job->fd, job->data, job->sz, job->offset);
+		break;
+	default:
+		r = fileio_fsync(job->fd);
+		break;
+	}
+	memcpy(result, &r, sizeof(r));
+	memcpy(result + sizeof(r), &job->op, sizeof(job->op));
+	job->resp->msg = p;
+	job->resp->sz = sz;
+	park_message(job->task, job->resp);
+	free(job);
+}
+
+struct offload_job {
+	struct job j;
+	struct ltask *task;
+	// the response, see job_message()
+	struct message *resp;
+	ltask_offload_func func;
+	void *arg;
+};
+
+// The payload of the response is the pointer returned
+static void
+offload_execute(struct job *j) {
+	struct offload_job *job = (struct offload_job *)j;
+	void *r = job->func(job->arg);
+	uint8_t *p = (uint8_t *)message_payload_new(sizeof(r));
+	if (p) {
+		memcpy(p + sizeof(uint32_t), &r, sizeof(r));
+		job->resp->msg = p;
+		job->resp->sz = sizeof(r);
+	} else {
+		// out of memory, respond an error without payload (r is lost)
+		job->resp->type = MESSAGE_ERROR;
+	}
+	park_message(job->task, job->resp);
+	free(job);
+}
+
 struct task_context {
 	int logthread;
 	int threads_count;
@@ -907,9 +1485,13 @@ ltask_run(lua_State *L) {
 		}
 	}
 
-	int threads_count = worker_n + logthread - usemainthread;
+	int timerthread = task->timer ? 1 : 0;
+	int reactorthread = task->reactor ? 1 : 0;
+	int jobthread = task->jobs ? task->config->io_thread : 0;
+	int threads_total = worker_n + timerthread + reactorthread + jobthread + logthread;
+	int threads_count = threads_total - usemainthread;
 
-	struct task_context *ctx = (struct task_context *)lua_newuserdatauv(L, sizeof(*ctx) + (threads_count-1+usemainthread) * sizeof(struct thread), 0);
+	struct task_context *ctx = (struct task_context *)lua_newuserdatauv(L, sizeof(*ctx) + (threads_total-1) * sizeof(struct thread), 0);
 
 	ctx->logthread = logthread;
 	ctx->threads_count = threads_count;
@@ -921,8 +1503,21 @@ ltask_run(lua_State *L) {
 		t[i].ud = (void *)&task->workers[i];
 	}
 	task->thread_count = worker_n;
+	if (timerthread) {
+		t[worker_n].func = thread_timer;
+		t[worker_n].ud = (void *)task;
+		task->timer_thread = 1;
+	}
+	if (reactorthread) {
+		t[worker_n + timerthread].func = thread_reactor;
+		t[worker_n + timerthread].ud = (void *)task;
+	}
+	for (i=0;i<jobthread;i++) {
+		t[worker_n + timerthread + reactorthread + i].func = thread_job;
+		t[worker_n + timerthread + reactorthread + i].ud = (void *)task;
+	}
 	if (logthread) {
-		int logthread_index = threads_count-1;
+		int logthread_index = worker_n + timerthread + reactorthread + jobthread;
 		t[logthread_index].func = thread_logger;
 		t[logthread_index].ud = (void *)task;
 	}
@@ -947,7 +1542,7 @@ ltask_wait(lua_State *L) {
 	}
 	logqueue_delete(ctx->task->lqueue);
 	int i;
-	for (i=0;i<MAX_SOCKEVENT;i++) {
+	for (i=0;i<ctx->task->config->sockevent;i++) {
 		sockevent_close(&ctx->task->event[i]);
 	}
 	message_delete(ctx->task->external_last_message);
@@ -967,6 +1562,11 @@ ltask_deinit(lua_State *L) {
 	service_destory(task->services);
 	queue_delete(task->schedule);
 	timer_destroy(task->timer);
+	reactor_delete(task->reactor);
+	jobqueue_delete(task->jobs);
+	cond_release(&task->timer_trigger);
+	message_pool_exit();
+	chunkcache_exit();
 
 	lua_pushnil(L);
 	lua_setfield(L, LUA_REGISTRYINDEX, "LTASK_GLOBAL");
@@ -1066,7 +1666,7 @@ ltask_init_timer(lua_State *L) {
 	struct ltask *task = (struct ltask *)get_ptr(L, "LTASK_GLOBAL");
 	if (task->timer)
 		return luaL_error(L, "Timer can init only once");
-	task->timer = timer_init();
+	task->timer = timer_init(1000000 / task->config->timer_resolution, task->config->worker);
 
 	return 0;
 }
@@ -1095,7 +1695,8 @@ pushlog(struct ltask* task, service_id id, void *data, uint32_t sz) {
 	if (TI == NULL) {
 		msg.timestamp = 0;
 	} else {
-		msg.timestamp = timer_now(TI);
+		// in 1/100s
+		msg.timestamp = timer_now(TI) * 100 / timer_frequency(TI);
 	}
 	return logqueue_push(q, &msg);
 }
@@ -1191,11 +1792,6 @@ getS(lua_State *L) {
 
 // Timer
 
-struct timer_event {
-	session_t session;
-	service_id id;
-};
-
 static int
 ltask_timer_add(lua_State *L) {
 	const struct service_ud *S = getS(L);
@@ -1206,51 +1802,176 @@ ltask_timer_add(lua_State *L) {
 	struct timer_event ev;
 	ev.session = luaL_checkinteger(L, 1);
 	ev.id = S->id;
-	lua_Integer ti = luaL_checkinteger(L, 2);
-	if (ti < 0 || ti != (int)ti)
-		return luaL_error(L, "Invalid timer %d", ti);
-
-	timer_add(t, &ev, sizeof(ev), ti);
-	return 0;
-}
-
-struct timer_update_ud {
-	lua_State *L;
-	int n;
-};
-
-static void
-timer_callback(void *ud, void *arg) {
-	struct timer_update_ud *tu = (struct timer_update_ud *)ud;
-	struct timer_event *event = (arg);
-	lua_State *L = tu->L;
-	uint64_t v = event->session;
-	v = v << 32 | event->id.id;
-	lua_pushinteger(L, v);
-	int idx = ++tu->n;
-	lua_seti(L, 1, idx);
+	// ti is in 1/100s, and can be fractional when the timer resolution is finer.
+	lua_Number csec = luaL_checknumber(L, 2);
+	lua_Number ticks = csec * (timer_frequency(t) / 100);
+	if (!(ticks >= 0 && ticks < INT_MAX))
+		return luaL_error(L, "Invalid timer %f", csec);
+	int ti = (int)ticks;
+	if (ti < ticks)
+		++ti;
+
+	uint64_t handle;
+	// Each worker has its own insertion buffer
+	int buffer = current_worker ? current_worker->worker_id : -1;
+	if (timer_add(t, buffer, &ev, sizeof(ev), ti, &handle) && S->task->timer_thread)
+		timer_thread_trigger(S->task);
+	if (handle == 0)
+		return luaL_error(L, "Add timer failed");
+	lua_pushinteger(L, (lua_Integer)handle);
+	return 1;
 }
 
 static int
-ltask_timer_update(lua_State *L) {
+ltask_timer_cancel(lua_State *L) {
 	const struct service_ud *S = getS(L);
 	struct timer *t = S->task->timer;
 	if (t == NULL)
 		return luaL_error(L, "Init timer before bootstrap");
-	if (lua_gettop(L) > 1) {
-		lua_settop(L, 1);
-		luaL_checktype(L, 1, LUA_TTABLE);
-	}
-	struct timer_update_ud tu;
-	tu.L = L;
-	tu.n = 0;
-	timer_update(t, timer_callback, &tu);
-	int n = lua_rawlen(L, 1);
+	uint64_t handle = (uint64_t)luaL_checkinteger(L, 1);
+	lua_pushboolean(L, timer_cancel(t, handle));
+	return 1;
+}
+
+// Unpack the sessions of MESSAGE_TIMER into the table, and free the message
+static int
+ltask_unpack_timer(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	const uint8_t *p = (const uint8_t *)lua_touserdata(L, 1);
+	int n = (int)luaL_checkinteger(L, 2);
+	luaL_checktype(L, 3, LUA_TTABLE);
 	int i;
-	for (i=tu.n+1;i<=n;i++) {
+	for (i=0;i<n;i++) {
+		session_t session;
+		memcpy(&session, p + sizeof(uint32_t) + i * sizeof(session_t), sizeof(session));
+		lua_pushinteger(L, session);
+		lua_rawseti(L, 3, i+1);
+	}
+	message_payload_delete((void *)p);
+	lua_pushinteger(L, n);
+	return 1;
+}
+
+// session, op, fd (or filename for open), ...
+static int
+ltask_io_submit(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct jobqueue *Q = S->task->jobs;
+	if (Q == NULL)
+		return luaL_error(L, "Set io_thread in ltask.init first");
+	session_t session = (session_t)luaL_checkinteger(L, 1);
+	int op = luaL_checkoption(L, 2, NULL, io_ops);
+	const char *filename = NULL;
+	const char *mode = NULL;
+	const char *data = NULL;
+	size_t fsz = 0, msz = 0, sz = 0;
+	int fd = -1;
+	if (op == IO_OPEN) {
+		filename = luaL_checklstring(L, 3, &fsz);
+		mode = luaL_optlstring(L, 4, "r", &msz);
+	} else {
+		fd = (int)luaL_checkinteger(L, 3);
+	}
+	if (op == IO_READ) {
+		lua_Integer n = luaL_checkinteger(L, 4);
+		// The payload size is 31bits, see message_payload_new()
+		luaL_argcheck(L, n >= 0 && n <= INT32_MAX - (lua_Integer)IO_RESULT, 4, "Invalid size");
+		sz = (size_t)n;
+	} else if (op == IO_WRITE) {
+		data = luaL_checklstring(L, 4, &sz);
+	}
+	int64_t offset = (op == IO_READ || op == IO_WRITE) ? luaL_optinteger(L, 5, -1) : -1;
+
+	struct io_job *job = (struct io_job *)malloc(sizeof(*job) + fsz + msz + 2 + (data ? sz : 0));
+	if (job == NULL)
+		return luaL_error(L, "Out of memory");
+	job->resp = job_message(S, session);
+	if (job->resp == NULL) {
+		free(job);
+		return luaL_error(L, "Out of memory");
+	}
+	job->j.func = io_execute;
+	job->task = S->task;
+	job->op = op;
+	job->fd = fd;
+	job->offset = offset;
+	job->sz = sz;
+	if (filename) {
+		memcpy(job->data, filename, fsz + 1);
+		memcpy(job->data + fsz + 1, mode, msz + 1);
+	} else if (data) {
+		memcpy(job->data, data, sz);
+	}
+	jobqueue_push(Q, &job->j);
+	return 0;
+}
+
+// Unpack the response of io_submit, and free the message
+static int
+ltask_io_result(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	uint8_t *p = (uint8_t *)lua_touserdata(L, 1);
+	const uint8_t *result = p + sizeof(uint32_t);
+	int64_t r;
+	int op;
+	memcpy(&r, result, sizeof(r));
+	memcpy(&op, result + sizeof(r), sizeof(op));
+	int n = 1;
+	if (r < 0) {
 		lua_pushnil(L);
-		lua_seti(L, 1, i);
+		lua_pushstring(L, strerror((int)-r));
+		lua_pushinteger(L, -r);
+		n = 3;
+	} else if (op == IO_READ) {
+		lua_pushlstring(L, (const char *)result + IO_RESULT, (size_t)r);
+	} else {
+		lua_pushinteger(L, r);
 	}
+	message_payload_delete(p);
+	return n;
+}
+
+// session, func, arg
+static int
+ltask_offload_submit(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct jobqueue *Q = S->task->jobs;
+	if (Q == NULL)
+		return luaL_error(L, "Set io_thread in ltask.init first");
+	session_t session = (session_t)luaL_checkinteger(L, 1);
+	// Only the functions pushed by ltask_offload_pushfunc() have the metatable
+	const struct ltask_offload *f = (const struct ltask_offload *)luaL_checkudata(L, 2, LTASK_OFFLOAD_METATABLE);
+	ltask_offload_func func = f->func;
+	if (func == NULL)
+		return luaL_error(L, "Invalid offload function");
+	void *arg = lua_touserdata(L, 3);
+	struct offload_job *job = (struct offload_job *)malloc(sizeof(*job));
+	if (job == NULL)
+		return luaL_error(L, "Out of memory");
+	job->resp = job_message(S, session);
+	if (job->resp == NULL) {
+		free(job);
+		return luaL_error(L, "Out of memory");
+	}
+	job->j.func = offload_execute;
+	job->task = S->task;
+	job->func = func;
+	job->arg = arg;
+	jobqueue_push(Q, &job->j);
+	return 0;
+}
+
+// Unpack the response of offload_submit, and free the message
+static int
+ltask_offload_result(lua_State *L) {
+	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
+	uint8_t *p = (uint8_t *)lua_touserdata(L, 1);
+	void *r;
+	memcpy(&r, p + sizeof(uint32_t), sizeof(r));
+	message_payload_delete(p);
+	if (r == NULL)
+		return 0;
+	lua_pushlightuserdata(L, r);
 	return 1;
 }
 
@@ -1273,33 +1994,163 @@ gen_send_message(lua_State *L, service_id id) {
 	return message_new(&m);
 }
 
+static int
+send_message(lua_State *L, int receipt) {
+	const struct service_ud *S = getS(L);
+	struct message *msg = gen_send_message(L, S->id);
+	if (!lua_isyieldable(L)) {
+		message_delete(msg);
+		return luaL_error(L, "Can't send message in none-yieldable context");
+	}
+	if (service_send_message(S->task->services, S->id, msg, receipt)) {
+		// outbox is full, yield and try again
+		message_release(msg);
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 /*
 	integer to
 	integer session 
 	integer type
 	pointer message
 	integer sz
+
+	return false if the outbox is full
  */
 static inline int
 lsend_message(lua_State *L) {
-	const struct service_ud *S = getS(L);
-	struct message *msg = gen_send_message(L, S->id);
-	if (!lua_isyieldable(L)) {
+	return send_message(L, 1);
+}
+
+// Same as send_message, but nobody waits for the receipt. Read the failures by message_bounce.
+static inline int
+lqueue_message(lua_State *L) {
+	return send_message(L, 0);
+}
+
+// Push msg into the mailbox of msg->to directly, without yielding. Returns receipt (and the message if it's not DONE)
+// If park is true, the message is parked in the waiter list of the target when its mailbox is full,
+// and it's delivered as soon as the target pops a message. Otherwise returns MESSAGE_RECEIPT_BLOCK.
+// The waiter list is limited too, the sender gets MESSAGE_RECEIPT_BLOCK and then MESSAGE_UNBLOCK from the target,
+// unless park is PARK_FORCE.
+#define PARK_FORCE 2
+static int
+push_message(lua_State *L, const struct service_ud *S, struct message *msg, int park) {
+	struct ltask *task = S->task;
+	service_id to = msg->to;
+	if (to.id == SERVICE_ID_SYSTEM) {
 		message_delete(msg);
-		return luaL_error(L, "Can't send message in none-yieldable context");
+		return luaL_error(L, "Can't push message to system");
+	}
+	int r;
+	if (park) {
+		service_id sender = S->id;
+		if (park == PARK_FORCE)
+			sender.id = SERVICE_ID_SYSTEM;
+		r = service_park_message(task->services, to, msg, sender);
+	} else {
+		r = service_push_message(task->services, to, msg);
+	}
+	if (r == 0 || (r == 1 && park)) {
+		wakeup_service(task, to);
+		lua_pushinteger(L, MESSAGE_RECEIPT_DONE);
+		return 1;
 	}
-	if (service_send_message(S->task->services, S->id, msg)) {
-		// error
+	if (r == -2) {
 		message_delete(msg);
-		return luaL_error(L, "Can't send message");
+		return luaL_error(L, "Out of memory");
+	}
+	if (r > 0) {
+		wakeup_service(task, to);
+		lua_pushinteger(L, MESSAGE_RECEIPT_BLOCK);
+	} else {
+		lua_pushinteger(L, MESSAGE_RECEIPT_ERROR);
+	}
+	// returns the message to the sender, and delete the header
+	if (msg->msg) {
+		lua_pushlightuserdata(L, msg->msg);
+		lua_pushinteger(L, msg->sz);
+		message_release(msg);
+		return 3;
+	}
+	message_delete(msg);
+	return 1;
+}
+
+/*
+	integer to
+	integer session
+	integer type
+	pointer message
+	integer sz
+
+	return receipt (and message, sz if it's not delivered)
+ */
+static int
+lpush_message(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct message *msg = gen_send_message(L, S->id);
+	return push_message(L, S, msg, 0);
+}
+
+// The same as push_message, but the message waits in the target when its mailbox is full.
+// It's blocked only if too many messages are waiting, see push_message.
+static int
+ldeliver_message(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct message *msg = gen_send_message(L, S->id);
+	return push_message(L, S, msg, 1);
+}
+
+// The same as deliver_message, but the sender is the 2nd argument (the origin of a forwarded message).
+// Any service can set any sender here, it's not checked. The sender is only the address of the response,
+// so don't use it to authenticate a request.
+// If force is true, the message is never blocked (parked anyway). It's for the blocked messages when the sender quits.
+// to, from, session, type, msg, sz, force
+static int
+lforward_message(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	service_id from = { (unsigned int)luaL_checkinteger(L, 2) };
+	int park = lua_toboolean(L, 7) ? PARK_FORCE : 1;
+	lua_remove(L, 2);
+	struct message *msg = gen_send_message(L, from);
+	return push_message(L, S, msg, park);
+}
+
+// Notify the senders blocked by id, they send the messages again.
+static void
+unblock_senders(struct ltask *task, service_id id, int all) {
+	service_id senders[16];
+	int n;
+	while ((n = service_blocked_senders(task->services, id, senders, 16, all)) > 0) {
+		int i;
+		for (i=0;i<n;i++) {
+			struct message m;
+			m.from = id;
+			m.to = senders[i];
+			m.session = 0;
+			m.type = MESSAGE_UNBLOCK;
+			m.msg = NULL;
+			m.sz = 0;
+			struct message *msg;
+			while ((msg = message_new(&m)) == NULL) {
+				// out of memory, the sender waits for it
+				sys_yield();
+			}
+			park_message(task, msg);
+		}
 	}
-	return 0;
 }
 
 static inline int
 lrecv_message(lua_State *L) {
 	const struct service_ud *S = getS(L);
 	struct message *m = service_pop_message(S->task->services, S->id);
+	unblock_senders(S->task, S->id, 0);
 	if (m == NULL)
 		return 0;
 	int r = 3;
@@ -1310,10 +2161,14 @@ lrecv_message(lua_State *L) {
 		lua_pushlightuserdata(L, m->msg);
 		lua_pushinteger(L, m->sz);
 		r += 2;
-		m->msg = NULL;
-		m->sz = 0;
+	} else if (m->sz) {
+		// No payload, sz is a value (the events from reactor)
+		lua_pushnil(L);
+		lua_pushinteger(L, m->sz);
+		r += 2;
 	}
-	message_delete(m);
+	// lua owns the payload now
+	message_release(m);
 
 	return r;
 }
@@ -1338,9 +2193,7 @@ lmessage_receipt(lua_State *L) {
 	if (m->msg) {
 		lua_pushlightuserdata(L, m->msg);
 		lua_pushinteger(L, m->sz);
-		m->msg = NULL;
-		m->sz = 0;
-		message_delete(m);
+		message_release(m);
 		return 3;
 	} else {
 		message_delete(m);
@@ -1348,10 +2201,36 @@ lmessage_receipt(lua_State *L) {
 	}
 }
 
+/*
+	return receipt, to, session, type, message, sz
+ */
+static inline int
+lmessage_bounce(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	int receipt;
+	struct message *m = service_read_bounce(S->task->services, S->id, &receipt);
+	if (m == NULL)
+		return 0;
+	lua_pushinteger(L, receipt);
+	lua_pushinteger(L, m->to.id);
+	lua_pushinteger(L, m->session);
+	lua_pushinteger(L, m->type);
+	if (m->msg) {
+		lua_pushlightuserdata(L, m->msg);
+		lua_pushinteger(L, m->sz);
+		message_release(m);
+		return 6;
+	}
+	message_delete(m);
+	return 4;
+}
+
 static int
 ltask_sleep(lua_State *L) {
-	lua_Integer csec = luaL_optinteger(L, 1, 0);
-	sys_sleep(csec);
+	// in 1/1000s, can be fractional
+	lua_Number msec = luaL_optnumber(L, 1, 0);
+	if (msec > 0)
+		sys_usleep((uint64_t)(msec * 1000));
 	return 0;
 }
 
@@ -1399,9 +2278,18 @@ ltask_now(lua_State *L) {
 	}
 	uint32_t start = timer_starttime(TI);
 	uint64_t now = timer_now(TI);
-	lua_pushinteger(L, start + now / 100);
-	lua_pushinteger(L, (uint64_t)start * 100 + now);
-	return 2;
+	uint64_t freq = timer_frequency(TI);
+	lua_pushinteger(L, start + now / freq);
+	lua_pushinteger(L, (uint64_t)start * 100 + now * 100 / freq);
+	lua_pushinteger(L, (uint64_t)start * 1000000 + now * (1000000 / freq));
+	return 3;
+}
+
+static int
+ltask_timer_resolution(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	lua_pushinteger(L, S->task->config->timer_resolution);
+	return 1;
 }
 
 static int
@@ -1412,6 +2300,75 @@ ltask_counter(lua_State *L) {
 	return 1;
 }
 
+static int
+lmessage_stat(lua_State *L) {
+	struct message_stat s;
+	message_stat(&s);
+	lua_createtable(L, 0, 4);
+	lua_pushinteger(L, (lua_Integer)s.alloc);
+	lua_setfield(L, -2, "alloc");
+	lua_pushinteger(L, (lua_Integer)s.refill);
+	lua_setfield(L, -2, "refill");
+	lua_pushinteger(L, (lua_Integer)s.malloc);
+	lua_setfield(L, -2, "malloc");
+	lua_pushinteger(L, s.pool);
+	lua_setfield(L, -2, "pool");
+	return 1;
+}
+
+static int
+lchunkcache_stat(lua_State *L) {
+	struct chunkcache_stat s;
+	chunkcache_stat(&s);
+	lua_createtable(L, 0, 5);
+	lua_pushinteger(L, s.n);
+	lua_setfield(L, -2, "n");
+	lua_pushinteger(L, (lua_Integer)s.bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushinteger(L, (lua_Integer)s.limit);
+	lua_setfield(L, -2, "limit");
+	lua_pushinteger(L, (lua_Integer)s.hit);
+	lua_setfield(L, -2, "hit");
+	lua_pushinteger(L, (lua_Integer)s.miss);
+	lua_setfield(L, -2, "miss");
+	return 1;
+}
+
+// The same as loadfile([filename [, mode [, env]]]) in lua, but the compiled chunks are shared by all services.
+static int
+lloadfile(lua_State *L) {
+	const char *filename = luaL_checkstring(L, 1);
+	const char *mode = luaL_optstring(L, 2, NULL);
+	int env = !lua_isnone(L, 3) ? 3 : 0;
+	if (chunkcache_loadfile(L, filename, mode) != LUA_OK) {
+		lua_pushnil(L);
+		lua_insert(L, -2);
+		return 2;
+	}
+	if (env) {
+		lua_pushvalue(L, env);
+		if (!lua_setupvalue(L, -2, 1))
+			lua_pop(L, 1);
+	}
+	return 1;
+}
+
+static int
+lmailbox_stat(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct mailbox_stat s;
+	if (service_mailbox_stat(S->task->services, S->id, &s))
+		return 0;
+	lua_createtable(L, 0, 3);
+	lua_pushinteger(L, s.length);
+	lua_setfield(L, -2, "length");
+	lua_pushinteger(L, s.capacity);
+	lua_setfield(L, -2, "capacity");
+	lua_pushinteger(L, s.highwater);
+	lua_setfield(L, -2, "highwater");
+	return 1;
+}
+
 static int
 ltask_pushlog(lua_State *L) {
 	luaL_checktype(L, 1, LUA_TLIGHTUSERDATA);
@@ -1523,10 +2480,35 @@ ltask_cpucost(lua_State *L) {
 	return 1;
 }
 
+/*
+	integer n : messages handled in this resume
+
+	return true if the service can handle more messages before yielding
+ */
+static int
+lresume_budget(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	const struct ltask_config *config = S->task->config;
+	lua_Integer n = luaL_checkinteger(L, 1);
+	if (n >= config->batch) {
+		lua_pushboolean(L, 0);
+		return 1;
+	}
+	if (config->batch_time > 0) {
+		uint64_t cost = service_resume_cost(S->task->services, S->id);
+		if (cost * 1000000 / systime_frequency() >= (uint64_t)config->batch_time) {
+			lua_pushboolean(L, 0);
+			return 1;
+		}
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
 static int
 alloc_sockevent(struct ltask *task) {
 	int i;
-	for (i=0;i<MAX_SOCKEVENT;i++) {
+	for (i=0;i<task->config->sockevent;i++) {
 		if (atomic_int_cas(&task->event_init[i], 0, 1)) {
 			return i;
 		}
@@ -1534,6 +2516,59 @@ alloc_sockevent(struct ltask *task) {
 	return -1;
 }
 
+static int
+getfd(lua_State *L, int index) {
+	// The fd from eventinit is a lightuserdata
+	if (lua_islightuserdata(L, index))
+		return (int)(intptr_t)lua_touserdata(L, index);
+	return (int)luaL_checkinteger(L, index);
+}
+
+// fd, "r"/"w"/"rw", session
+static int
+ltask_reactor_add(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct reactor *R = S->task->reactor;
+	if (R == NULL)
+		return luaL_error(L, "Enable reactor in ltask.init first");
+	int fd = getfd(L, 1);
+	const char *what = luaL_checkstring(L, 2);
+	session_t session = (session_t)luaL_checkinteger(L, 3);
+	int events = 0;
+	if (strchr(what, 'r'))
+		events |= REACTOR_READ;
+	if (strchr(what, 'w'))
+		events |= REACTOR_WRITE;
+	if (events == 0)
+		return luaL_error(L, "Invalid events %s", what);
+	int r = reactor_add(R, fd, events, S->id.id, session);
+	if (r > 0)
+		return luaL_error(L, "fd %d is waited already (%s)", fd, what);
+	else if (r < 0)
+		return luaL_error(L, "Wait fd %d failed", fd);
+	service_reactor_set(S->task->services, S->id);
+	return 0;
+}
+
+// fd, returns the sessions still waiting for it
+static int
+ltask_reactor_del(lua_State *L) {
+	const struct service_ud *S = getS(L);
+	struct reactor *R = S->task->reactor;
+	if (R == NULL)
+		return luaL_error(L, "Enable reactor in ltask.init first");
+	int fd = getfd(L, 1);
+	struct reactor_event ev[2];
+	int n = reactor_del(R, fd, S->id.id, ev);
+	if (n < 0)
+		return luaL_error(L, "fd %d is waited by another service", fd);
+	int i;
+	for (i=0;i<n;i++) {
+		lua_pushinteger(L, ev[i].session);
+	}
+	return n;
+}
+
 static int
 ltask_eventwait_(lua_State *L) {
 	struct sockevent *e = (struct sockevent *)lua_touserdata(L, lua_upvalueindex(1));
@@ -1655,15 +2690,27 @@ luaopen_ltask(lua_State *L) {
 	// 这个数组定义了 ltask 库中的函数。使用 luaL_setfuncs 将它们添加到 Lua 表中
 	luaL_Reg l2[] = {
 		{ "send_message", lsend_message },
+		{ "queue_message", lqueue_message },
+		{ "push_message", lpush_message },
+		{ "deliver_message", ldeliver_message },
+		{ "forward_message", lforward_message },
 		{ "recv_message", lrecv_message },
+		{ "resume_budget", lresume_budget },
+		{ "message_stat", lmessage_stat },
+		{ "mailbox_stat", lmailbox_stat },
+		{ "chunkcache_stat", lchunkcache_stat },
+		{ "loadfile", lloadfile },
 		{ "message_receipt", lmessage_receipt },
+		{ "message_bounce", lmessage_bounce },
 		{ "touch_service", ltask_touch_service },
 		{ "self", lself },
 		{ "worker_id", lworker_id },
 		{ "worker_bind", lworker_bind },
 		{ "timer_add", ltask_timer_add },
-		{ "timer_update", ltask_timer_update },
+		{ "timer_cancel", ltask_timer_cancel },
+		{ "unpack_timer", ltask_unpack_timer },
 		{ "now", ltask_now },
+		{ "timer_resolution", ltask_timer_resolution },
 		{ "pushlog", ltask_pushlog },
 		{ "poplog", ltask_poplog },
 		{ "get_pushlog", ltask_get_pushlog },
@@ -1674,6 +2721,12 @@ luaopen_ltask(lua_State *L) {
 		{ "debuglog", ltask_debuglog },
 		{ "eventinit", ltask_eventinit },
 		{ "eventreset", ltask_eventreset },
+		{ "reactor_add", ltask_reactor_add },
+		{ "reactor_del", ltask_reactor_del },
+		{ "io_submit", ltask_io_submit },
+		{ "io_result", ltask_io_result },
+		{ "offload_submit", ltask_offload_submit },
+		{ "offload_result", ltask_offload_result },
 		{ NULL, NULL },
 	};
 
@@ -1768,6 +2821,10 @@ ltask_closeservice(lua_State *L) {
 		sockevent_close(&S->task->event[sockevent_id]);
 		atomic_int_store(&S->task->event_init[sockevent_id], 0);
 	}
+	if (S->task->reactor && service_reactor_get(S->task->services, id))
+		reactor_drop(S->task->reactor, sid);
+	// The senders get RECEIPT_ERROR when they send again
+	unblock_senders(S->task, id, 1);
 	int ret = close_service_messages(L, S->task->services, id);
 	service_delete(S->task->services, id);
 	return ret;
@@ -15,6 +15,8 @@
 #include <assert.h>
 #include <string.h>
 
+#include "message.h"
+
 #define TYPE_BOOLEAN 0
 
 #define TYPE_BOOLEAN_NIL 0
@@ -762,8 +764,8 @@ unpack_one(lua_State *L, struct read_block *rb) {
 
 static void *
 seri(struct block *b, int len) {
-	uint8_t * buffer = malloc(len + 4);
-	memcpy(buffer, &len, 4);	// write length
+	// write length, small buffer is stored inside a message header
+	uint8_t * buffer = message_payload_new(len);
 	uint8_t * ptr = buffer + 4;
 	while(len>0) {
 		if (len >= BLOCK_SIZE) {
@@ -783,8 +785,7 @@ seri(struct block *b, int len) {
 int
 seri_unpack(lua_State *L, void *buffer) {
 	int top = lua_gettop(L);
-	int len = 0;
-	memcpy(&len, buffer, 4);	// get length
+	int len = (int)message_payload_len(buffer);	// get length
 
 	struct read_block rb;
 	rball_init(&rb, (char *)buffer + 4, len);
@@ -820,7 +821,7 @@ seri_unpackptr(lua_State *L, void *buffer) {
 	lua_pushcfunction(L, seri_unpack_);
 	lua_pushlightuserdata(L, buffer);
 	int err = lua_pcall(L, 1, LUA_MULTRET, 0);
-	free(buffer);
+	message_payload_delete(buffer);
 	if (err != LUA_OK) {
 		lua_error(L);
 	}
@@ -920,7 +921,7 @@ luaseri_remove(lua_State *L) {
 	void * data = lua_touserdata(L, 1);
 	size_t sz = luaL_checkinteger(L, 2);
 	(void)sz;
-	free(data);
+	message_payload_delete(data);
 	return 0;
 }
 
@@ -0,0 +1,299 @@
+#include "mailbox.h"
+#include "queue.h"
+#include <stdlib.h>
+
+// The reader drains for so many times with a low peak length, then the mailbox shrinks
+#define MAILBOX_SHRINK_IDLE 64
+
+// A mailbox is a chain of bounded queues (segment). The writers push into the last one (tail),
+// and append a larger one when it's full. The reader pops from the first one (head), and retires it
+// when it's empty and no writer is pushing into it.
+// A writer may still hold a retired segment (it loaded the tail before), so the retired ones are freed
+// after an epoch flip : each writer is counted in active[epoch & 1] during mailbox_push(), the reader
+// flips the epoch and frees the segments retired before it when the old counter drops to 0.
+
+struct segment {
+	atomic_ptr next;
+	// 正在向这一段写入的线程数
+	atomic_int writers;
+	int size;
+	struct queue *q;
+	// 已退役、等待释放的段链表
+	struct segment *retired;
+};
+
+struct mailbox {
+	int init;
+	int cap;
+	// 当前纪元，只有读者修改
+	atomic_int epoch;
+	// 在各个纪元（奇偶）进入 mailbox_push 的写者数量
+	atomic_int active[2];
+	// 第一段，为 NULL 表示还没有分配。读者从这里开始
+	atomic_ptr first;
+	// 写者使用的最后一段
+	atomic_ptr tail;
+	// 消息数量，写入前增加，所以可能包括正在写入的消息
+	atomic_int count;
+	// 以下字段只有读者访问
+	struct segment *head;
+	// 最近退役的段，下一次翻转纪元后等待释放
+	struct segment *retired;
+	// 上一次翻转纪元前退役的段，active[limbo_epoch & 1] 为 0 后释放。同时只有一次翻转在等待
+	struct segment *limbo;
+	int limbo_epoch;
+	int idle;
+	int peak;
+	int highwater;
+};
+
+static struct segment *
+segment_new(int size) {
+	struct segment *s = (struct segment *)malloc(sizeof(*s));
+	if (s == NULL)
+		return NULL;
+	s->q = queue_new_mpsc_ptr(size);
+	if (s->q == NULL) {
+		free(s);
+		return NULL;
+	}
+	atomic_ptr_init(&s->next, NULL);
+	atomic_int_init(&s->writers, 0);
+	s->size = size;
+	s->retired = NULL;
+	return s;
+}
+
+static void
+segment_delete(struct segment *s) {
+	queue_delete(s->q);
+	free(s);
+}
+
+static inline int
+ptr_cas(atomic_ptr *p, void *oval, void *nval) {
+	uintptr_t v = (uintptr_t)oval;
+	return atomic_compare_exchange_strong(p, &v, (uintptr_t)nval);
+}
+
+struct mailbox *
+mailbox_new(int init, int cap) {
+	struct mailbox *m = (struct mailbox *)malloc(sizeof(*m));
+	if (m == NULL)
+		return NULL;
+	m->init = init < cap ? init : cap;
+	m->cap = cap;
+	atomic_int_init(&m->epoch, 0);
+	atomic_int_init(&m->active[0], 0);
+	atomic_int_init(&m->active[1], 0);
+	atomic_ptr_init(&m->first, NULL);
+	atomic_ptr_init(&m->tail, NULL);
+	atomic_int_init(&m->count, 0);
+	m->head = NULL;
+	m->retired = NULL;
+	m->limbo = NULL;
+	m->limbo_epoch = 0;
+	m->idle = 0;
+	m->peak = 0;
+	m->highwater = 0;
+	return m;
+}
+
+static void
+free_segments(struct segment *s) {
+	while (s) {
+		struct segment *next = s->retired;
+		segment_delete(s);
+		s = next;
+	}
+}
+
+// Calling by reader
+static void
+free_retired(struct mailbox *m) {
+	if (m->limbo) {
+		if (atomic_int_load(&m->active[m->limbo_epoch & 1]) != 0)
+			return;
+		// The writers entered before the flip have left
+		free_segments(m->limbo);
+		m->limbo = NULL;
+	}
+	if (m->retired) {
+		m->limbo = m->retired;
+		m->retired = NULL;
+		m->limbo_epoch = atomic_int_load(&m->epoch);
+		atomic_int_store(&m->epoch, m->limbo_epoch + 1);
+	}
+}
+
+void
+mailbox_delete(struct mailbox *m) {
+	if (m == NULL)
+		return;
+	free_segments(m->limbo);
+	free_segments(m->retired);
+	struct segment *s = m->head;
+	if (s == NULL)
+		s = (struct segment *)atomic_ptr_load(&m->first);
+	while (s) {
+		struct segment *next = (struct segment *)atomic_ptr_load(&s->next);
+		segment_delete(s);
+		s = next;
+	}
+	free(m);
+}
+
+// Append a segment after seg, returns the next one of seg (may be appended by others)
+static struct segment *
+append_segment(struct segment *seg, int size) {
+	struct segment *next = segment_new(size);
+	if (next == NULL)
+		return NULL;
+	if (!ptr_cas(&seg->next, NULL, next)) {
+		segment_delete(next);
+		next = (struct segment *)atomic_ptr_load(&seg->next);
+	}
+	return next;
+}
+
+static int
+push_segment(struct mailbox *m, void *v) {
+	for (;;) {
+		struct segment *seg = (struct segment *)atomic_ptr_load(&m->tail);
+		if (seg == NULL) {
+			// The first message, allocate the slots lazily
+			struct segment *s = (struct segment *)atomic_ptr_load(&m->first);
+			if (s == NULL) {
+				s = segment_new(m->init);
+				if (s == NULL)
+					break;
+				if (!ptr_cas(&m->first, NULL, s)) {
+					segment_delete(s);
+					s = (struct segment *)atomic_ptr_load(&m->first);
+				}
+			}
+			ptr_cas(&m->tail, NULL, s);
+			continue;
+		}
+		atomic_int_inc(&seg->writers);
+		if (atomic_ptr_load(&m->tail) != (void *)seg) {
+			// The reader may retire it, if it's not the tail
+			atomic_int_dec(&seg->writers);
+			continue;
+		}
+		int r = queue_push_ptr(seg->q, v);
+		atomic_int_dec(&seg->writers);
+		if (r == 0)
+			return 0;
+		// full
+		struct segment *next = (struct segment *)atomic_ptr_load(&seg->next);
+		if (next == NULL) {
+			if (seg->size >= m->cap)
+				break;
+			next = append_segment(seg, seg->size * 2);
+			if (next == NULL)
+				break;
+		}
+		ptr_cas(&m->tail, seg, next);
+	}
+	return 1;
+}
+
+int
+mailbox_push(struct mailbox *m, void *v) {
+	// The messages in all the segments are limited by cap
+	if (atomic_int_inc(&m->count) > m->cap) {
+		atomic_int_dec(&m->count);
+		return 1;
+	}
+	int e;
+	for (;;) {
+		e = atomic_int_load(&m->epoch);
+		atomic_int_inc(&m->active[e & 1]);
+		if (atomic_int_load(&m->epoch) == e)
+			break;
+		// The reader flipped it before we are counted
+		atomic_int_dec(&m->active[e & 1]);
+	}
+	int r = push_segment(m, v);
+	atomic_int_dec(&m->active[e & 1]);
+	if (r)
+		atomic_int_dec(&m->count);
+	return r;
+}
+
+static void
+try_shrink(struct mailbox *m, struct segment *seg) {
+	if (++m->idle < MAILBOX_SHRINK_IDLE)
+		return;
+	int peak = m->peak;
+	m->idle = 0;
+	m->peak = 0;
+	if (seg->size <= m->init || peak * 4 > seg->size)
+		return;
+	int size = m->init;
+	while (size < peak * 2)
+		size *= 2;
+	// Append a smaller one, the current one will be retired when it's empty
+	struct segment *next = append_segment(seg, size);
+	if (next)
+		ptr_cas(&m->tail, seg, next);
+}
+
+void *
+mailbox_pop(struct mailbox *m) {
+	if (m->limbo || m->retired)
+		free_retired(m);
+	struct segment *seg = m->head;
+	if (seg == NULL) {
+		// The tail may move on before the first pop
+		seg = (struct segment *)atomic_ptr_load(&m->first);
+		if (seg == NULL)
+			return NULL;
+		m->head = seg;
+	}
+	for (;;) {
+		void *v = queue_pop_ptr(seg->q);
+		if (v == NULL) {
+			struct segment *next = (struct segment *)atomic_ptr_load(&seg->next);
+			if (next == NULL) {
+				try_shrink(m, seg);
+				return NULL;
+			}
+			// Move tail first, so no more writers come in
+			ptr_cas(&m->tail, seg, next);
+			if (atomic_int_load(&seg->writers) != 0) {
+				// Keep the order, the writer will wakeup the service after pushing
+				return NULL;
+			}
+			v = queue_pop_ptr(seg->q);
+			if (v == NULL) {
+				// Retire it, the writers may still read it, see free_retired()
+				m->head = next;
+				seg->retired = m->retired;
+				m->retired = seg;
+				seg = next;
+				continue;
+			}
+		}
+		int n = atomic_int_dec(&m->count) + 1;
+		if (n > m->peak)
+			m->peak = n;
+		if (n > m->highwater)
+			m->highwater = n;
+		return v;
+	}
+}
+
+int
+mailbox_length(struct mailbox *m) {
+	return atomic_int_load(&m->count);
+}
+
+void
+mailbox_stat(struct mailbox *m, struct mailbox_stat *s) {
+	s->length = mailbox_length(m);
+	struct segment *seg = (struct segment *)atomic_ptr_load(&m->tail);
+	s->capacity = seg ? seg->size : 0;
+	s->highwater = m->highwater;
+}
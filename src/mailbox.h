@@ -0,0 +1,33 @@
+#ifndef ltask_mailbox_h
+#define ltask_mailbox_h
+
+#include "atomic.h"
+
+// The mailbox of a service, allow only one reader (the service) and multiple writers.
+// It starts with no slots, grows on demand up to the cap, and shrinks back after the reader has been idle for a while.
+
+struct mailbox;
+
+struct mailbox_stat {
+	// 当前的消息数量
+	int length;
+	// 当前（最后一段）的容量
+	int capacity;
+	// 出现过的最大消息数量
+	int highwater;
+};
+
+// init and cap are power of 2. No more than cap messages in the mailbox.
+struct mailbox * mailbox_new(int init, int cap);
+// The messages should be popped before
+void mailbox_delete(struct mailbox *m);
+// 0 succ, 1 full (or out of memory)
+int mailbox_push(struct mailbox *m, void *v);
+// Calling by reader. returns NULL if empty
+void * mailbox_pop(struct mailbox *m);
+// May include the messages being pushed
+int mailbox_length(struct mailbox *m);
+// Calling by reader
+void mailbox_stat(struct mailbox *m, struct mailbox_stat *s);
+
+#endif
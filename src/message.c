@@ -1,19 +1,262 @@
 #include "message.h"
+#include "atomic.h"
+#include "spinlock.h"
+#include "thread.h"
 #include <stdlib.h>
+#include <string.h>
+
+// Each thread caches the freed message headers, and exchanges them with the global pool in batch.
+#define MESSAGE_CACHE 64
+#define MESSAGE_CACHE_BATCH 32
+#define MESSAGE_STAT_FLUSH 256
+
+// The free headers are linked by the field msg.
+
+// Every header has room for a small payload, so a small message is only one allocation.
+struct message_block {
+	struct message m;
+	uint8_t data[MESSAGE_INLINE];
+};
+
+#define block_data(m) (((struct message_block *)(m))->data)
+#define payload_block(p) ((struct message *)((uint8_t *)(p) - offsetof(struct message_block, data)))
+
+struct message_cache {
+	struct message *free;
+	int n;
+	// message_new calls not flushed into the global counter yet
+	int alloc;
+};
+
+struct message_pool {
+	struct spinlock lock;
+	int init;
+	// 全局空闲链表，线程缓存过多时归还到这里，缓存空了从这里成批取回。
+	struct message *free;
+	int n;
+	// 统计：message_new 调用次数，从全局池取回的批次数，以及真正 malloc 的次数。
+	atomic_ullong alloc;
+	atomic_ullong refill;
+	atomic_ullong malloc;
+};
+
+static struct message_pool G;
+static THREAD_LOCAL struct message_cache C;
+
+void
+message_pool_init() {
+	if (G.init)
+		return;
+	spinlock_init(&G.lock);
+	G.free = NULL;
+	G.n = 0;
+	atomic_init(&G.alloc, 0);
+	atomic_init(&G.refill, 0);
+	atomic_init(&G.malloc, 0);
+	G.init = 1;
+}
+
+static void
+free_list(struct message *m) {
+	while (m) {
+		struct message *next = (struct message *)m->msg;
+		free(m);
+		m = next;
+	}
+}
+
+void
+message_pool_exit() {
+	if (!G.init)
+		return;
+	message_cache_flush();
+	spinlock_acquire(&G.lock);
+	struct message *m = G.free;
+	G.free = NULL;
+	G.n = 0;
+	spinlock_release(&G.lock);
+	free_list(m);
+	spinlock_destroy(&G.lock);
+	G.init = 0;
+}
+
+void
+message_cache_flush() {
+	struct message *m = C.free;
+	if (m == NULL)
+		return;
+	struct message *last = m;
+	while (last->msg) {
+		last = (struct message *)last->msg;
+	}
+	spinlock_acquire(&G.lock);
+	last->msg = G.free;
+	G.free = m;
+	G.n += C.n;
+	spinlock_release(&G.lock);
+	C.free = NULL;
+	C.n = 0;
+}
+
+// Take a batch from the global pool
+static void
+cache_refill() {
+	if (!G.init || G.n == 0)	// read without lock, it's only a hint
+		return;
+	spinlock_acquire(&G.lock);
+	struct message *m = G.free;
+	struct message *last = NULL;
+	int n = 0;
+	while (m && n < MESSAGE_CACHE_BATCH) {
+		last = m;
+		m = (struct message *)m->msg;
+		++n;
+	}
+	if (n > 0) {
+		last->msg = C.free;
+		C.free = G.free;
+		C.n += n;
+		G.free = m;
+		G.n -= n;
+	}
+	spinlock_release(&G.lock);
+	if (n > 0)
+		atomic_fetch_add(&G.refill, 1);
+}
+
+// Give a batch back to the global pool
+static void
+cache_spill() {
+	struct message *first = C.free;
+	struct message *last = first;
+	int n = 1;
+	while (n < MESSAGE_CACHE_BATCH) {
+		last = (struct message *)last->msg;
+		++n;
+	}
+	C.free = (struct message *)last->msg;
+	C.n -= n;
+	spinlock_acquire(&G.lock);
+	last->msg = G.free;
+	G.free = first;
+	G.n += n;
+	spinlock_release(&G.lock);
+}
+
+static struct message *
+header_new() {
+	if (++C.alloc >= MESSAGE_STAT_FLUSH) {
+		atomic_fetch_add(&G.alloc, C.alloc);
+		C.alloc = 0;
+	}
+	if (C.free == NULL)
+		cache_refill();
+	struct message * r = C.free;
+	if (r) {
+		C.free = (struct message *)r->msg;
+		--C.n;
+	} else {
+		atomic_fetch_add(&G.malloc, 1);
+		r = (struct message *)malloc(sizeof(struct message_block));
+	}
+	return r;
+}
+
+static void
+header_delete(struct message *msg) {
+	if (!G.init) {
+		free(msg);
+		return;
+	}
+	msg->msg = C.free;
+	C.free = msg;
+	if (++C.n > MESSAGE_CACHE)
+		cache_spill();
+}
+
+static inline uint32_t
+payload_header(const void *payload) {
+	uint32_t h;
+	memcpy(&h, payload, sizeof(h));
+	return h;
+}
 
 struct message *
 message_new(struct message *msg) {
-	struct message * r = (struct message *)malloc(sizeof(*r));
-	if (r == NULL)
-		return NULL;
-	*r = *msg;
+	struct message * r;
+	if (msg->msg && (payload_header(msg->msg) & MESSAGE_INLINE_FLAG)) {
+		// The payload is inside a header already, use it
+		r = payload_block(msg->msg);
+	} else {
+		r = header_new();
+		if (r == NULL)
+			return NULL;
+	}
+	r->from = msg->from;
+	r->to = msg->to;
+	r->session = msg->session;
+	r->type = msg->type;
+	r->msg = msg->msg;
+	r->sz = msg->sz;
 	return r;
 }
 
 void
 message_delete(struct message *msg) {
 	if (msg) {
-		free(msg->msg);
-		free(msg);
+		if (msg->msg != block_data(msg))
+			message_payload_delete(msg->msg);
+		header_delete(msg);
 	}
 }
+
+void
+message_release(struct message *msg) {
+	// The inline payload keeps the header
+	if (msg && msg->msg != block_data(msg))
+		header_delete(msg);
+}
+
+void *
+message_payload_new(uint32_t len) {
+	uint32_t h = len;
+	uint8_t *p;
+	if (len + sizeof(h) <= MESSAGE_INLINE) {
+		struct message *m = header_new();
+		if (m == NULL)
+			return NULL;
+		p = block_data(m);
+		m->msg = p;
+		h |= MESSAGE_INLINE_FLAG;
+	} else {
+		p = (uint8_t *)malloc(len + sizeof(h));
+		if (p == NULL)
+			return NULL;
+	}
+	memcpy(p, &h, sizeof(h));
+	return p;
+}
+
+void
+message_payload_delete(void *payload) {
+	if (payload == NULL)
+		return;
+	if (payload_header(payload) & MESSAGE_INLINE_FLAG) {
+		header_delete(payload_block(payload));
+	} else {
+		free(payload);
+	}
+}
+
+uint32_t
+message_payload_len(const void *payload) {
+	return payload_header(payload) & ~MESSAGE_INLINE_FLAG;
+}
+
+void
+message_stat(struct message_stat *s) {
+	s->alloc = atomic_load(&G.alloc) + C.alloc;
+	s->refill = atomic_load(&G.refill);
+	s->malloc = atomic_load(&G.malloc);
+	s->pool = G.n;
+}
@@ -2,6 +2,7 @@
 #define ltask_message_h
 
 #include <stddef.h>
+#include <stdint.h>
 #include "service.h"
 
 typedef unsigned int session_t;
@@ -12,6 +13,10 @@ typedef unsigned int session_t;
 #define MESSAGE_ERROR 3
 #define MESSAGE_SIGNAL 4
 #define MESSAGE_IDLE 5
+// A batch of expired timers for a service, the payload is an array of sz sessions (after the 4 bytes length).
+#define MESSAGE_TIMER 6
+// The sender (from) has room for the messages blocked before, see service_park_message(). No payload.
+#define MESSAGE_UNBLOCK 7
 
 #define MESSAGE_RECEIPT_NONE 0
 #define MESSAGE_RECEIPT_DONE 1
@@ -19,6 +24,10 @@ typedef unsigned int session_t;
 #define MESSAGE_RECEIPT_BLOCK 3
 #define MESSAGE_RECEIPT_RESPONCE 4
 
+// Payloads no larger than MESSAGE_INLINE (including the 4 bytes length) are stored inside the message header.
+#define MESSAGE_INLINE 96
+#define MESSAGE_INLINE_FLAG 0x80000000u
+
 // If to == 0, it's a schedule message. It should be post from root service (1).
 // type is MESSAGE_SCHEDULE_* from is the parameter (for DEL service_id).
 #define MESSAGE_SCHEDULE_NEW 0
@@ -51,8 +60,30 @@ struct message {
 	size_t sz;
 };
 
+// 消息头的分配统计，用于确认缓存命中率（1 - malloc / alloc）。
+struct message_stat {
+	uint64_t alloc;
+	uint64_t refill;
+	uint64_t malloc;
+	int pool;
+};
+
 struct message * message_new(struct message *msg);
+// delete the message and its payload
 void message_delete(struct message *msg);
+// delete the message only, the payload is given to others (lua)
+void message_release(struct message *msg);
+
+// The payload begins with 4 bytes length (seri buffer), MESSAGE_INLINE_FLAG is set if it's inside a message header.
+void * message_payload_new(uint32_t len);
+void message_payload_delete(void *payload);
+uint32_t message_payload_len(const void *payload);
+// The message headers are cached by each thread, and a global pool
+void message_pool_init();
+void message_pool_exit();
+// Give back the cache of current thread, call it before the thread exits
+void message_cache_flush();
+void message_stat(struct message_stat *s);
 
 
 #endif
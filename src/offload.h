@@ -0,0 +1,27 @@
+#ifndef ltask_offload_h
+#define ltask_offload_h
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// The C modules can pass a function of this type to ltask.offload(func, arg), see ltask_offload_pushfunc().
+// It runs in a job thread (see .io_thread in ltask.init), so it can block, but it must not touch any lua_State.
+// arg is the lightuserdata passed to ltask.offload, and the returned pointer is returned to lua as a lightuserdata.
+typedef void * (*ltask_offload_func)(void *arg);
+
+#define LTASK_OFFLOAD_METATABLE "LTASK_OFFLOAD"
+
+struct ltask_offload {
+	ltask_offload_func func;
+};
+
+// Push func as a userdata with a private metatable, ltask.offload accepts nothing else.
+static inline void
+ltask_offload_pushfunc(lua_State *L, ltask_offload_func func) {
+	struct ltask_offload *f = (struct ltask_offload *)lua_newuserdatauv(L, sizeof(*f), 0);
+	f->func = func;
+	luaL_newmetatable(L, LTASK_OFFLOAD_METATABLE);
+	lua_setmetatable(L, -2);
+}
+
+#endif
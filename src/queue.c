@@ -9,11 +9,20 @@ struct queue {
 	// 表示队列的总大小，即可以容纳的元素数量。这个字段通常在队列初始化时设定，并帮助管理队列的使用。
 	int size;
 
+	// 每个槽位的序号，只有多写者队列使用（为 NULL 时是单写单读队列）。
+	// 多写者队列的 head/tail 是不断增长的计数，而不是槽位下标。
+	atomic_int *seq;
+
+	// 把 head 和 tail 放在不同的 cache line 上，避免读者和写者之间的伪共享。
+	CACHE_LINE_PAD(pad_header, sizeof(int) + sizeof(atomic_int *));
+
 	// 这是一个原子整数，指示队列的头部位置。通过使用原子类型，能够保证在多线程环境中安全地访问和更新头部索引，避免数据竞争。
 	atomic_int head;
+	CACHE_LINE_PAD(pad_head, sizeof(atomic_int));
 
 	// 与 head 类似，这是一个原子整数，指示队列的尾部位置。它用于追踪下一个要插入元素的位置，同样通过原子类型确保线程安全。
 	atomic_int tail;
+	CACHE_LINE_PAD(pad_tail, sizeof(atomic_int));
 
 	// 这是一个指向指针数组的字段，实际上是一个动态大小的数组，存储队列中的实际数据。由于使用了灵活的数组成员（void * data[1]），可以在创建队列时指定其实际大小，从而支持变长队列。
 	void * data[1];
@@ -30,13 +39,26 @@ queue_ptr(struct queue *q) {
 }
 
 static struct queue *
-queue_new(int size, int stride) {
+queue_new(int size, int stride, int mpsc) {
 	assert(ispow2((unsigned)size));
 	size_t sz = offsetof(struct queue, data) + stride * size;
+	size_t seq_offset = 0;
+	if (mpsc) {
+		seq_offset = (sz + sizeof(atomic_int) - 1) / sizeof(atomic_int) * sizeof(atomic_int);
+		sz = seq_offset + sizeof(atomic_int) * size;
+	}
 	struct queue *q = (struct queue *)malloc(sz);
 	if (q == NULL)
 		return NULL;
 	q->size = size;
+	q->seq = NULL;
+	if (mpsc) {
+		q->seq = (atomic_int *)((char *)q + seq_offset);
+		int i;
+		for (i=0;i<size;i++) {
+			atomic_int_init(&q->seq[i], i);
+		}
+	}
 	atomic_int_init(&q->head, 0);
 	atomic_int_init(&q->tail, 0);
 	return q;
@@ -44,12 +66,22 @@ queue_new(int size, int stride) {
 
 struct queue *
 queue_new_int(int size) {
-	return queue_new(size, sizeof(int));
+	return queue_new(size, sizeof(int), 0);
 }
 
 struct queue *
 queue_new_ptr(int size) {
-	return queue_new(size, sizeof(void *));
+	return queue_new(size, sizeof(void *), 0);
+}
+
+struct queue *
+queue_new_mpsc_int(int size) {
+	return queue_new(size, sizeof(int), 1);
+}
+
+struct queue *
+queue_new_mpsc_ptr(int size) {
+	return queue_new(size, sizeof(void *), 1);
 }
 
 void
@@ -63,7 +95,7 @@ queue_position(struct queue *q, int p) {
 }
 
 static inline int
-queue_push_open(struct queue *q) {
+queue_push_open_spsc(struct queue *q) {
 	int tail = atomic_int_load(&q->tail);
 	if (queue_position(q, tail + 1) == atomic_int_load(&q->head))
 		return -1;
@@ -71,14 +103,14 @@ queue_push_open(struct queue *q) {
 }
 
 static inline void
-queue_push_close(struct queue *q, int tail) {
+queue_push_close_spsc(struct queue *q, int tail) {
 	// Allow only one writer
 	assert(atomic_int_load(&q->tail) == tail);
 	atomic_int_store(&q->tail, queue_position(q, tail + 1));
 }
 
 static inline int
-queue_pop_open(struct queue *q) {
+queue_pop_open_spsc(struct queue *q) {
 	int head = atomic_int_load(&q->head);
 	if (head == atomic_int_load(&q->tail))
 		return -1;
@@ -86,62 +118,154 @@ queue_pop_open(struct queue *q) {
 }
 
 static inline void
-queue_pop_close(struct queue *q, int head) {
+queue_pop_close_spsc(struct queue *q, int head) {
 	// Allow only one reader
 	assert(atomic_int_load(&q->head) == head);
 	atomic_int_store(&q->head, queue_position(q, head + 1));
 }
 
+// The counters wrap around, compare them as unsigned
+static inline int
+seq_diff(int a, int b) {
+	return (int)((unsigned)a - (unsigned)b);
+}
+
+static inline int
+seq_next(int a, int n) {
+	return (int)((unsigned)a + (unsigned)n);
+}
+
+// returns the slot reserved by this writer, or -1 if the queue is full
+static inline int
+queue_push_open_mpsc(struct queue *q, int *ticket) {
+	int tail = atomic_int_load(&q->tail);
+	for (;;) {
+		int diff = seq_diff(atomic_int_load(&q->seq[queue_position(q, tail)]), tail);
+		if (diff == 0) {
+			if (atomic_compare_exchange_weak(&q->tail, &tail, seq_next(tail, 1))) {
+				*ticket = tail;
+				return queue_position(q, tail);
+			}
+			// tail is reloaded by CAS
+		} else if (diff < 0) {
+			// the reader has not released this slot yet
+			return -1;
+		} else {
+			tail = atomic_int_load(&q->tail);
+		}
+	}
+}
+
+static inline void
+queue_push_close_mpsc(struct queue *q, int ticket) {
+	atomic_int_store(&q->seq[queue_position(q, ticket)], seq_next(ticket, 1));
+}
+
+static inline int
+queue_pop_open_mpsc(struct queue *q, int *ticket) {
+	int head = atomic_int_load(&q->head);
+	if (seq_diff(atomic_int_load(&q->seq[queue_position(q, head)]), seq_next(head, 1)) < 0)
+		return -1;
+	*ticket = head;
+	return queue_position(q, head);
+}
+
+static inline void
+queue_pop_close_mpsc(struct queue *q, int ticket) {
+	// Allow only one reader
+	assert(atomic_int_load(&q->head) == ticket);
+	atomic_int_store(&q->seq[queue_position(q, ticket)], seq_next(ticket, q->size));
+	atomic_int_store(&q->head, seq_next(ticket, 1));
+}
+
+static inline int
+queue_push_open(struct queue *q, int *ticket) {
+	if (q->seq)
+		return queue_push_open_mpsc(q, ticket);
+	return (*ticket = queue_push_open_spsc(q));
+}
+
+static inline void
+queue_push_close(struct queue *q, int ticket) {
+	if (q->seq)
+		queue_push_close_mpsc(q, ticket);
+	else
+		queue_push_close_spsc(q, ticket);
+}
+
+static inline int
+queue_pop_open(struct queue *q, int *ticket) {
+	if (q->seq)
+		return queue_pop_open_mpsc(q, ticket);
+	return (*ticket = queue_pop_open_spsc(q));
+}
+
+static inline void
+queue_pop_close(struct queue *q, int ticket) {
+	if (q->seq)
+		queue_pop_close_mpsc(q, ticket);
+	else
+		queue_pop_close_spsc(q, ticket);
+}
+
 int
 queue_push_int(struct queue *q, int v) {
 	assert(v != 0);
-	int tail = queue_push_open(q);
+	int ticket;
+	int tail = queue_push_open(q, &ticket);
 	if (tail < 0)
 		return 1;
 	int *data = queue_int(q);
 	data[tail] = v;
-	queue_push_close(q, tail);
+	queue_push_close(q, ticket);
 	return 0;
 }
 
 int
 queue_pop_int(struct queue *q) {
-	int head = queue_pop_open(q);
+	int ticket;
+	int head = queue_pop_open(q, &ticket);
 	if (head < 0)
 		return 0;
 	int *data = queue_int(q);
 	int v = data[head];
-	queue_pop_close(q, head);
+	queue_pop_close(q, ticket);
 	return v;
 }
 
 int
 queue_push_ptr(struct queue *q, void *v) {
 	assert(v != NULL);
-	int tail = queue_push_open(q);
+	int ticket;
+	int tail = queue_push_open(q, &ticket);
 	if (tail < 0)
 		return 1;
 	void **data = queue_ptr(q);
 	data[tail] = v;
-	queue_push_close(q, tail);
+	queue_push_close(q, ticket);
 	return 0;
 }
 
 void *
 queue_pop_ptr(struct queue *q) {
-	int head = queue_pop_open(q);
+	int ticket;
+	int head = queue_pop_open(q, &ticket);
 	if (head < 0)
 		return NULL;
 	void **data = queue_ptr(q);
 	void *v = data[head];
-	queue_pop_close(q, head);
+	queue_pop_close(q, ticket);
 	return v;
 }
 
 int
 queue_length(struct queue *q) {
+	if (q->seq) {
+		// may include the slots reserved but not written yet
+		return seq_diff(atomic_int_load(&q->tail), atomic_int_load(&q->head));
+	}
 	int len = atomic_int_load(&q->tail) - atomic_int_load(&q->head);
 	if (len < 0)
 		len += q->size;
 	return len;
-}
\ No newline at end of file
+}
@@ -8,6 +8,9 @@ struct queue;
 
 struct queue * queue_new_int(int size);
 struct queue * queue_new_ptr(int size);
+// Allow only one reader and multiple writers
+struct queue * queue_new_mpsc_int(int size);
+struct queue * queue_new_mpsc_ptr(int size);
 void queue_delete(struct queue *q);
 // 0 succ
 int queue_push_int(struct queue *q, int v);
@@ -0,0 +1,280 @@
+#include "reactor.h"
+
+#include <stddef.h>
+
+#if defined(__linux__)
+
+#include "spinlock.h"
+
+#include <sys/epoll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define REACTOR_BATCH 64
+
+struct reactor_fd {
+	// 等待这个 fd 的服务，0 表示没有
+	unsigned int service;
+	// 等待读和写的 session ，0 表示没有（"rw" 时两者相同）
+	unsigned int read;
+	unsigned int write;
+};
+
+struct reactor {
+	int epfd;
+	struct spinlock lock;
+	// 以 fd 为下标的等待记录
+	int n;
+	struct reactor_fd *fds;
+};
+
+struct reactor *
+reactor_new(void) {
+	int fd = epoll_create1(EPOLL_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+	struct reactor *R = (struct reactor *)malloc(sizeof(*R));
+	if (R == NULL) {
+		close(fd);
+		return NULL;
+	}
+	R->epfd = fd;
+	spinlock_init(&R->lock);
+	R->n = 0;
+	R->fds = NULL;
+	return R;
+}
+
+void
+reactor_delete(struct reactor *R) {
+	if (R == NULL)
+		return;
+	close(R->epfd);
+	spinlock_destroy(&R->lock);
+	free(R->fds);
+	free(R);
+}
+
+static int
+record_events(struct reactor_fd *r) {
+	int events = 0;
+	if (r->read)
+		events |= REACTOR_READ;
+	if (r->write)
+		events |= REACTOR_WRITE;
+	return events;
+}
+
+// Arm the fd with the events of the waiters (one shot), it's kept in epoll after the event.
+static int
+rearm(struct reactor *R, int fd, int events) {
+	struct epoll_event ev;
+	ev.events = EPOLLONESHOT;
+	if (events & REACTOR_READ)
+		ev.events |= EPOLLIN;
+	if (events & REACTOR_WRITE)
+		ev.events |= EPOLLOUT;
+	ev.data.u64 = 0;
+	ev.data.fd = fd;
+	if (epoll_ctl(R->epfd, EPOLL_CTL_MOD, fd, &ev) == 0)
+		return 0;
+	if (errno != ENOENT)
+		return -1;
+	return epoll_ctl(R->epfd, EPOLL_CTL_ADD, fd, &ev) == 0 ? 0 : -1;
+}
+
+static struct reactor_fd *
+get_record(struct reactor *R, int fd) {
+	if (fd < R->n)
+		return &R->fds[fd];
+	int n = R->n ? R->n : 64;
+	while (n <= fd)
+		n *= 2;
+	struct reactor_fd *fds = (struct reactor_fd *)realloc(R->fds, n * sizeof(*fds));
+	if (fds == NULL)
+		return NULL;
+	memset(fds + R->n, 0, (n - R->n) * sizeof(*fds));
+	R->fds = fds;
+	R->n = n;
+	return &fds[fd];
+}
+
+int
+reactor_add(struct reactor *R, int fd, int events, unsigned int service, unsigned int session) {
+	if (fd < 0)
+		return -1;
+	int ret = -1;
+	spinlock_acquire(&R->lock);
+	struct reactor_fd *r = get_record(R, fd);
+	if (r == NULL)
+		goto _out;
+	if (r->service && r->service != service) {
+		ret = 1;
+		goto _out;
+	}
+	if (((events & REACTOR_READ) && r->read) || ((events & REACTOR_WRITE) && r->write)) {
+		ret = 1;
+		goto _out;
+	}
+	struct reactor_fd old = *r;
+	r->service = service;
+	if (events & REACTOR_READ)
+		r->read = session;
+	if (events & REACTOR_WRITE)
+		r->write = session;
+	ret = rearm(R, fd, record_events(r));
+	if (ret)
+		*r = old;
+_out:
+	spinlock_release(&R->lock);
+	return ret;
+}
+
+int
+reactor_del(struct reactor *R, int fd, unsigned int service, struct reactor_event ev[2]) {
+	int n = 0;
+	struct epoll_event e;
+	spinlock_acquire(&R->lock);
+	if (fd >= 0 && fd < R->n && R->fds[fd].service && R->fds[fd].service != service) {
+		spinlock_release(&R->lock);
+		return -1;
+	}
+	epoll_ctl(R->epfd, EPOLL_CTL_DEL, fd, &e);
+	if (fd >= 0 && fd < R->n) {
+		struct reactor_fd *r = &R->fds[fd];
+		if (r->read) {
+			ev[n].service = r->service;
+			ev[n].session = r->read;
+			ev[n].events = REACTOR_ERROR;
+			++n;
+		}
+		if (r->write && r->write != r->read) {
+			ev[n].service = r->service;
+			ev[n].session = r->write;
+			ev[n].events = REACTOR_ERROR;
+			++n;
+		}
+		memset(r, 0, sizeof(*r));
+	}
+	spinlock_release(&R->lock);
+	return n;
+}
+
+void
+reactor_drop(struct reactor *R, unsigned int service) {
+	struct epoll_event e;
+	int i;
+	spinlock_acquire(&R->lock);
+	for (i=0;i<R->n;i++) {
+		struct reactor_fd *r = &R->fds[i];
+		if (r->service == service) {
+			epoll_ctl(R->epfd, EPOLL_CTL_DEL, i, &e);
+			memset(r, 0, sizeof(*r));
+		}
+	}
+	spinlock_release(&R->lock);
+}
+
+static inline void
+add_event(struct reactor_event *ev, unsigned int service, unsigned int session, int events) {
+	ev->service = service;
+	ev->session = session;
+	ev->events = events;
+}
+
+// Report the events to the waiters of fd, and rearm the rest. returns the number of events.
+static int
+dispatch_fd(struct reactor *R, int fd, int events, struct reactor_event ev[2]) {
+	int n = 0;
+	spinlock_acquire(&R->lock);
+	if (fd < R->n && R->fds[fd].service) {
+		struct reactor_fd *r = &R->fds[fd];
+		if (r->read && r->read == r->write) {
+			// "rw" in one session
+			add_event(&ev[n++], r->service, r->read, events);
+			r->read = r->write = 0;
+		} else {
+			if (r->read && (events & (REACTOR_READ | REACTOR_ERROR))) {
+				add_event(&ev[n++], r->service, r->read, events & (REACTOR_READ | REACTOR_ERROR));
+				r->read = 0;
+			}
+			if (r->write && (events & (REACTOR_WRITE | REACTOR_ERROR))) {
+				add_event(&ev[n++], r->service, r->write, events & (REACTOR_WRITE | REACTOR_ERROR));
+				r->write = 0;
+			}
+		}
+		int rest = record_events(r);
+		if (rest == 0) {
+			r->service = 0;
+		} else if (rearm(R, fd, rest)) {
+			// can't wait any more, wake up the rest with error
+			if (r->read)
+				add_event(&ev[n++], r->service, r->read, REACTOR_ERROR);
+			if (r->write)
+				add_event(&ev[n++], r->service, r->write, REACTOR_ERROR);
+			memset(r, 0, sizeof(*r));
+		}
+	}
+	spinlock_release(&R->lock);
+	return n;
+}
+
+int
+reactor_wait(struct reactor *R, struct reactor_event *ev, int max, int timeout) {
+	struct epoll_event e[REACTOR_BATCH];
+	// Each fd reports 2 events at most
+	max /= 2;
+	if (max > REACTOR_BATCH)
+		max = REACTOR_BATCH;
+	int n = epoll_wait(R->epfd, e, max, timeout);
+	if (n < 0)
+		return 0;	// EINTR
+	int i;
+	int r = 0;
+	for (i=0;i<n;i++) {
+		uint32_t flag = e[i].events;
+		int events = 0;
+		if (flag & EPOLLIN)
+			events |= REACTOR_READ;
+		if (flag & EPOLLOUT)
+			events |= REACTOR_WRITE;
+		if (flag & (EPOLLERR | EPOLLHUP))
+			events |= REACTOR_ERROR;
+		r += dispatch_fd(R, e[i].data.fd, events, &ev[r]);
+	}
+	return r;
+}
+
+#else
+
+struct reactor *
+reactor_new(void) {
+	return NULL;
+}
+
+void
+reactor_delete(struct reactor *R) {
+}
+
+int
+reactor_add(struct reactor *R, int fd, int events, unsigned int service, unsigned int session) {
+	return -1;
+}
+
+int
+reactor_del(struct reactor *R, int fd, unsigned int service, struct reactor_event ev[2]) {
+	return 0;
+}
+
+void
+reactor_drop(struct reactor *R, unsigned int service) {
+}
+
+int
+reactor_wait(struct reactor *R, struct reactor_event *ev, int max, int timeout) {
+	return 0;
+}
+
+#endif
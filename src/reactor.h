@@ -0,0 +1,43 @@
+#ifndef ltask_reactor_h
+#define ltask_reactor_h
+
+#include <stdint.h>
+
+// I/O readiness notification for the services (epoll on linux).
+// Each fd keeps a waiter record : one service, with a session waiting for read and one for write.
+// Each reactor_add() waits once, the session is removed from the record when its event is reported.
+
+#define REACTOR_READ 1
+#define REACTOR_WRITE 2
+#define REACTOR_ERROR 4
+
+struct reactor_event {
+	// 等待的服务和 session
+	unsigned int service;
+	unsigned int session;
+	// REACTOR_READ / REACTOR_WRITE / REACTOR_ERROR 的组合
+	int events;
+};
+
+struct reactor;
+
+// returns NULL if it's not supported on this platform
+struct reactor * reactor_new(void);
+
+void reactor_delete(struct reactor *R);
+
+// Wait events (REACTOR_READ | REACTOR_WRITE) of fd once, the masks of read and write waiters are merged.
+// 0 : succ, 1 : the direction is waited already or the fd is waited by another service, -1 : error
+int reactor_add(struct reactor *R, int fd, int events, unsigned int service, unsigned int session);
+
+// Remove fd waited by service, the sessions still waiting are returned in ev (REACTOR_ERROR), no more than 2.
+// returns the number of sessions, or -1 if fd is waited by another service (nothing changed).
+int reactor_del(struct reactor *R, int fd, unsigned int service, struct reactor_event ev[2]);
+
+// Forget all the fds waited by a dead service. It scans all the fds, call it only if the service ever waited.
+void reactor_drop(struct reactor *R, unsigned int service);
+
+// Wait no more than timeout (1/1000s), returns the number of events in ev.
+int reactor_wait(struct reactor *R, struct reactor_event *ev, int max, int timeout);
+
+#endif
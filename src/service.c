@@ -1,8 +1,13 @@
 #include "service.h"
-#include "queue.h"
+#include "atomic.h"
+#include "arena.h"
+#include "mailbox.h"
+#include "chunkcache.h"
+#include "spinlock.h"
 #include "config.h"
 #include "message.h"
 #include "systime.h"
+#include "sysapi.h"
 
 #include <lua.h>
 #include <lauxlib.h>
@@ -24,6 +29,10 @@
 #define TYPEID_NONEOBJECT 5
 #define TYPEID_COUNT 6
 
+// in_free flags of a slot
+#define SLOT_INRING 1
+#define SLOT_FREEING 2
+
 static int
 lua_typeid[LUA_NUMTYPES] = {
 	TYPEID_NONEOBJECT,	// LUA_TNIL
@@ -41,10 +50,68 @@ struct memory_stat {
 	size_t count[TYPEID_COUNT];
 	size_t mem;
 	size_t limit;
+	// NULL if the service uses malloc directly
+	struct arena *arena;
+};
+
+struct outbox_slot {
+	struct message *msg;
+	// out : 1 if the sender waits for the receipt ; bounce : MESSAGE_RECEIPT_*
+	int receipt;
+};
+
+// 服务的发件箱：服务运行时可以连续投递多条消息，调度器在服务让出后一次性派发。
+// 不需要回执的消息如果投递失败，会连同回执类型一起放进 bounce 环，等服务下次运行时处理。
+// 发件箱只会被服务自身（RUNNING 时）和调度器（DONE 时）访问，两者不会同时发生，所以不需要原子操作。
+struct outbox {
+	int size;
+	unsigned int out_head;
+	unsigned int out_tail;
+	unsigned int bounce_head;
+	unsigned int bounce_tail;
+	struct outbox_slot *bounce;
+	struct outbox_slot out[1];
+};
+
+// 调度器每条消息都要访问的字段。它们按槽位紧密排列在 service_pool 的数组中，不需要先找到 struct service 。
+// 槽位的记录不会释放，所以其它工作线程总可以访问（先比较 id ）。
+// 每条记录独占缓存行，status 和 ref 被很多线程写，不和相邻的服务共享缓存行。
+struct service_hot {
+	// 服务的唯一标识符，低位是槽位，高位是代数。删除后为 0 。
+	CACHE_LINE_ALIGN service_id id;
+
+	// 服务的当前状态，通常包括运行中、等待、阻塞或已停止等状态，用于调度和管理服务。
+	// 其它工作线程会直接投递消息并把 IDLE 改为 SCHEDULE，所以使用原子操作。
+	atomic_int status;
+
+	// 正在直接向这个服务投递消息的线程数。删除服务时要等它归零，才能释放消息队列。
+	atomic_int ref;
+
+	// 停放的消息数量，只在 park_lock 内修改
+	atomic_int parked;
+
+	// 回执类型（MESSAGE_RECEIPT_*），服务等待的回执，bounce 是回执附带的消息。
+	int receipt;
+
+	// 表示绑定到此服务的工作线程的 ID，帮助调度器了解哪个线程在处理该服务的请求。
+	int binding_thread;
+
+	// 用于sockevent的 ID，通常与事件通知系统关联，帮助处理网络事件。
+	int sockevent_id;
+
+	// 指向消息队列的指针。服务通过此队列接收来自其他服务或外部系统的消息。
+	// 队列的空间按需分配和增长，空闲一段时间后收缩。
+	struct mailbox *msg;
+
+	// 发件箱，用于存储当前服务准备发送的消息，以及发送失败的异步消息。
+	struct outbox *out;
 };
 
 // struct service 确保了 Ltask 系统能够灵活地管理多个服务实例，通过有效的消息传递和状态管理，支持高效的任务调度。
 struct service {
+	// 槽位中的热字段
+	struct service_hot *h;
+
 	// 指向当前 lua_State的指针。每个服务在执行其逻辑时会使用此lua_State来运行 Lua 代码.
 	lua_State *L;
 	/*
@@ -82,30 +149,19 @@ struct service {
 	// 指向另一个 lua_State的指针。可能用于支持协程或并行任务处理，允许服务异步执行
 	lua_State *rL;
 
-	// 指向消息队列的指针。服务通过此队列接收来自其他服务或外部系统的消息。
-	struct queue *msg;
-
-	// 指向输出消息的指针。用于存储当前服务准备发送的消息。
-	struct message *out;
+	// 邮箱满时停放的消息（等待者列表），环形数组。服务取消息时按顺序移入邮箱。
+	struct message **park;
+	int park_head;
+	int park_cap;
+	struct spinlock park_lock;
+	// 停放消息达到上限后被阻塞的发送者，停放的消息少于上限时通知它们（MESSAGE_UNBLOCK）。在 park_lock 内修改
+	service_id *blocked;
+	int blocked_cap;
+	atomic_int blocked_n;
 
 	// 指向反弹消息的指针。用于处理需要返回给发送者的消息，通常在服务出错时使用。 
 	struct message *bounce;
 
-	// 服务的当前状态，通常包括运行中、等待、阻塞或已停止等状态，用于调度和管理服务。
-	int status;
-
-	// 消息接收计数器，跟踪该服务接收到的消息数量，便于统计和监控。
-	int receipt;
-
-	// 表示绑定到此服务的工作线程的 ID，帮助调度器了解哪个线程在处理该服务的请求。
-	int binding_thread;
-
-	// 用于sockevent的 ID，通常与事件通知系统关联，帮助处理网络事件。
-	int sockevent_id;
-
-	// 服务的唯一标识符，这个 ID 用于在系统中唯一标识每个服务实例，确保管理的精确性。 
-	service_id id;
-
 	// 服务的标签，用于给服务一个可读的名称或描述，便于调试和日志记录。
 	char label[32];
 
@@ -117,6 +173,9 @@ struct service {
 
 	// 记录服务的时钟时间戳，用于处理超时或调度逻辑，帮助调度器决定服务的运行顺序。
 	uint64_t clock;
+
+	// 服务是否用 reactor 等待过 fd ，没有等待过的服务退出时不必清理 reactor
+	int reactor;
 };
 
 
@@ -128,10 +187,34 @@ struct service_pool {
 	// 表示当前服务池中服务的数量。此字段对于监控服务的数量和动态调整资源非常重要。
 	int queue_length;
 
-	// 服务池的唯一标识符。这个 ID 使得不同的服务池可以被区分和管理，确保在系统中不会出现冲突.
-	unsigned int id;
+	// 消息队列的初始容量
+	int queue_init;
+
+	// 每个服务发件箱的容量
+	int outbox_length;
+
+	// 服务的 lua 虚拟机是否使用独立的内存池
+	int arena;
+
+	// 服务 id 的低 shift 位是槽位，高位是槽位的代数。删除服务时代数加一，发往旧 id 的消息不会送到复用槽位的新服务。
+	int shift;
+
+	// 空闲槽位的 FIFO 环，每个槽位最多在环里出现一次（in_free 的 SLOT_INRING 标记），分配和回收都是 O(1) 。
+	// 正在释放的槽位有 SLOT_FREEING 标记，释放完成前不会被分配。
+	// 根服务在工作线程中删除服务，调度器分配服务，所以用 lock 保护。
+	struct spinlock lock;
+	unsigned int free_head;
+	unsigned int free_tail;
+	unsigned int *free_slot;
+	unsigned int *generation;
+	uint8_t *in_free;
+
+	// 每个槽位的热字段，与 s 一一对应，创建服务池时一次分配，按 CACHE_LINE_SIZE 对齐。
+	struct service_hot *hot;
+	void *hot_ptr;
 
 	// 这是一个指向服务指针的指针，实际上是一个动态数组，存储了所有服务的指针。通过这个结构，服务可以动态添加或移除，灵活地管理服务的生命周期。
+	// 这里是不常访问的字段（lua 虚拟机，标签，内存统计等），在槽位第一次使用时分配。
 	struct service **s;
 };
 
@@ -141,38 +224,134 @@ service_create(struct ltask_config *config) {
 	struct service_pool tmp;
 	assert(ispow2(config->max_service));
 	tmp.mask = config->max_service - 1;
-	tmp.id = 0;
+	tmp.shift = 0;
+	while ((1 << tmp.shift) < config->max_service)
+		++tmp.shift;
 	tmp.queue_length = config->queue;
+	tmp.queue_init = config->queue_init;
+	tmp.outbox_length = config->outbox;
+	tmp.arena = config->arena;
 	tmp.s = (struct service **)malloc(sizeof(struct service *) * config->max_service);
 	if (tmp.s == NULL)
 		return NULL;
+	tmp.free_slot = (unsigned int *)malloc((sizeof(unsigned int) * 2 + 1) * config->max_service);
+	if (tmp.free_slot == NULL) {
+		free(tmp.s);
+		return NULL;
+	}
+	tmp.generation = tmp.free_slot + config->max_service;
+	tmp.in_free = (uint8_t *)(tmp.generation + config->max_service);
+	tmp.hot_ptr = malloc(sizeof(struct service_hot) * config->max_service + CACHE_LINE_SIZE - 1);
+	tmp.hot = (struct service_hot *)(((uintptr_t)tmp.hot_ptr + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
 	struct service_pool * r = (struct service_pool *)malloc(sizeof(tmp));
+	if (tmp.hot_ptr == NULL || r == NULL) {
+		free(r);
+		free(tmp.hot_ptr);
+		free(tmp.free_slot);
+		free(tmp.s);
+		return NULL;
+	}
 	*r = tmp;
+	spinlock_init(&r->lock);
 	int i;
 	for (i=0;i<config->max_service;i++) {
 		r->s[i] = NULL;
+		struct service_hot *h = &r->hot[i];
+		h->id.id = 0;
+		atomic_int_init(&h->status, SERVICE_STATUS_DEAD);
+		atomic_int_init(&h->ref, 0);
+		atomic_int_init(&h->parked, 0);
+		h->receipt = MESSAGE_RECEIPT_NONE;
+		h->binding_thread = -1;
+		h->sockevent_id = -1;
+		h->msg = NULL;
+		h->out = NULL;
+		// Slot 0 begins at generation 1, id 0 is SERVICE_ID_SYSTEM. Give it out at last.
+		r->free_slot[i] = (i + 1) & r->mask;
+		r->generation[i] = (i == 0);
+		r->in_free[i] = SLOT_INRING;
 	}
+	r->free_head = 0;
+	r->free_tail = config->max_service;
 	return r;
 }
 
+static struct outbox *
+outbox_new(int size) {
+	assert(ispow2(size));
+	struct outbox *o = (struct outbox *)malloc(sizeof(*o) + sizeof(struct outbox_slot) * (size * 2 - 1));
+	if (o == NULL)
+		return NULL;
+	o->size = size;
+	o->out_head = 0;
+	o->out_tail = 0;
+	o->bounce_head = 0;
+	o->bounce_tail = 0;
+	o->bounce = &o->out[size];
+	return o;
+}
+
+static void
+outbox_delete(struct outbox *o) {
+	if (o == NULL)
+		return;
+	for (;o->out_head != o->out_tail; o->out_head++) {
+		message_delete(o->out[o->out_head & (o->size - 1)].msg);
+	}
+	for (;o->bounce_head != o->bounce_tail; o->bounce_head++) {
+		message_delete(o->bounce[o->bounce_head & (o->size - 1)].msg);
+	}
+	free(o);
+}
+
+// Bounced messages occupy the outbox capacity too, so the bounce ring can't overflow.
+// The last slot is reserved for the signal, see service_send_signal()
+static inline int
+outbox_full(struct outbox *o) {
+	return (int)(o->out_tail - o->out_head + o->bounce_tail - o->bounce_head) >= o->size - 1;
+}
+
 static void
 free_service(struct service *S) {
-	if (S->L != NULL)
+	if (S->L != NULL) {
 		lua_close(S->L);
-	if (S->msg) {
+		S->L = NULL;
+		S->rL = NULL;
+	}
+	// lua_close() may be called by service_init() when it fails
+	arena_delete(S->stat.arena);
+	S->stat.arena = NULL;
+	if (S->h->msg) {
 		for (;;) {
-			struct message *m = queue_pop_ptr(S->msg);
+			struct message *m = mailbox_pop(S->h->msg);
 			if (m) {
 				message_delete(m);
 			} else {
 				break;
 			}
 		}
-		queue_delete(S->msg);
+		mailbox_delete(S->h->msg);
+		S->h->msg = NULL;
 	}
-	message_delete(S->out);
+	int i;
+	int n = atomic_int_load(&S->h->parked);
+	for (i=0;i<n;i++) {
+		message_delete(S->park[(S->park_head + i) % S->park_cap]);
+	}
+	free(S->park);
+	S->park = NULL;
+	S->park_head = 0;
+	S->park_cap = 0;
+	atomic_int_store(&S->h->parked, 0);
+	free(S->blocked);
+	S->blocked = NULL;
+	S->blocked_cap = 0;
+	atomic_int_store(&S->blocked_n, 0);
+	outbox_delete(S->h->out);
+	S->h->out = NULL;
 	message_delete(S->bounce);
-	S->receipt = MESSAGE_RECEIPT_NONE;
+	S->bounce = NULL;
+	S->h->receipt = MESSAGE_RECEIPT_NONE;
 }
 
 void
@@ -183,10 +362,16 @@ service_destory(struct service_pool *p) {
 	for (i=0;i<=p->mask;i++) {
 		struct service *s = p->s[i];
 		if (s) {
-			free_service(s);
+			if (s->h->id.id != 0)
+				free_service(s);
+			spinlock_destroy(&s->park_lock);
+			free(s);
 		}
 	}
 	free(p->s);
+	free(p->hot_ptr);
+	free(p->free_slot);
+	spinlock_destroy(&p->lock);
 	free(p);
 }
 
@@ -211,52 +396,114 @@ service_slot(struct service_pool *p, unsigned int id) {
 	return &p->s[id & p->mask];
 }
 
+// The records are kept after deleting (id == 0), because other workers may still touch them.
+// Calling with p->lock
+static inline int
+slot_used(struct service_pool *p, unsigned int id) {
+	unsigned int slot = id & p->mask;
+	return p->hot[slot].id.id != 0 || (p->in_free[slot] & SLOT_FREEING);
+}
+
+// Calling with p->lock
+static inline unsigned int
+make_id(struct service_pool *p, unsigned int slot) {
+	unsigned int id = (p->generation[slot] << p->shift) | slot;
+	if (id == 0) {
+		// The generation wraps around, skip SERVICE_ID_SYSTEM
+		++p->generation[slot];
+		id = p->generation[slot] << p->shift;
+	}
+	return id;
+}
+
+// Calling with p->lock. Returns 0 if no free slot
+static unsigned int
+alloc_id(struct service_pool *p, unsigned int sid) {
+	if (sid != 0) {
+		if (slot_used(p, sid))
+			return 0;
+		// It stays in the free ring, and will be skipped when it's used
+		p->generation[sid & p->mask] = sid >> p->shift;
+		return sid;
+	}
+	while (p->free_head != p->free_tail) {
+		unsigned int slot = p->free_slot[p->free_head++ & p->mask];
+		p->in_free[slot] &= ~SLOT_INRING;
+		if (!slot_used(p, slot))
+			return make_id(p, slot);
+	}
+	return 0;
+}
+
+// Calling with p->lock
+static void
+free_slot(struct service_pool *p, unsigned int slot) {
+	if (!(p->in_free[slot] & SLOT_INRING)) {
+		p->in_free[slot] |= SLOT_INRING;
+		p->free_slot[p->free_tail++ & p->mask] = slot;
+	}
+}
+
 service_id
 service_new(struct service_pool *p, unsigned int sid) {
 	service_id result = { 0 };
-	unsigned int id;
-	if (sid != 0) {
-		id = sid;
-		if (*service_slot(p, id) != NULL) {
+	spinlock_acquire(&p->lock);
+	unsigned int id = alloc_id(p, sid);
+	if (id == 0) {
+		spinlock_release(&p->lock);
+		return result;
+	}
+	struct service *s = *service_slot(p, id);
+	if (s == NULL) {
+		s = (struct service *)malloc(sizeof(*s));
+		if (s == NULL) {
+			free_slot(p, id & p->mask);
+			spinlock_release(&p->lock);
 			return result;
 		}
-	} else {
-		id = p->id;
-		int i = 0;
-		while (id == 0 || *service_slot(p, id) != NULL) {
-			++id;
-			if (++i > p->mask) {
-				return result;
-			}
-		}
-		p->id = id + 1;
+		s->h = &p->hot[id & p->mask];
+		spinlock_init(&s->park_lock);
+		s->park = NULL;
+		s->park_head = 0;
+		s->park_cap = 0;
+		s->blocked = NULL;
+		s->blocked_cap = 0;
+		atomic_int_init(&s->blocked_n, 0);
+		*service_slot(p, id) = s;
 	}
-	struct service *s = (struct service *)malloc(sizeof(*s));
-	if (s == NULL)
-		return result;
 	s->L = NULL;
 	s->rL = NULL;
-	s->msg = NULL;
-	s->out = NULL;
 	s->bounce = NULL;
-	s->receipt = MESSAGE_RECEIPT_NONE;
-	s->id.id = id;
-	s->status = SERVICE_STATUS_UNINITIALIZED;
-	s->binding_thread = -1;
-	s->sockevent_id = -1;
 	s->cpucost = 0;
 	s->clock = 0;
-	*service_slot(p, id) = s;
+	s->reactor = 0;
+	struct service_hot *h = s->h;
+	h->msg = NULL;
+	h->out = NULL;
+	h->receipt = MESSAGE_RECEIPT_NONE;
+	h->binding_thread = -1;
+	h->sockevent_id = -1;
+	atomic_int_store(&h->status, SERVICE_STATUS_UNINITIALIZED);
+	h->id.id = id;
+	spinlock_release(&p->lock);
 	result.id = id;
 	return result;
 }
 
 static inline struct service *
 get_service(struct service_pool *p, service_id id) {
-	struct service *S = *service_slot(p, id.id);
-	if (S == NULL || S->id.id != id.id)
+	if (id.id == 0 || p->hot[id.id & p->mask].id.id != id.id)
 		return NULL;
-	return S;
+	return *service_slot(p, id.id);
+}
+
+// The scheduler reads the hot fields without touching struct service
+static inline struct service_hot *
+get_hot(struct service_pool *p, service_id id) {
+	struct service_hot *h = &p->hot[id.id & p->mask];
+	if (id.id == 0 || h->id.id != id.id)
+		return NULL;
+	return h;
 }
 
 static inline int
@@ -271,7 +518,10 @@ service_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
 	struct memory_stat *stat = (struct memory_stat *)ud;
 	if (nsize == 0) {
 		stat->mem -= osize;
-		free(ptr);
+		if (stat->arena)
+			arena_free(stat->arena, ptr, osize);
+		else
+			free(ptr);
 		return NULL;
 	} else if (ptr == NULL) {
 		// new object
@@ -282,7 +532,7 @@ service_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
 			int id = lua_typeid[osize];
 			stat->count[id]++;
 		}
-		void * ret = malloc(nsize);
+		void * ret = stat->arena ? arena_alloc(stat->arena, nsize) : malloc(nsize);
 		if (ret == NULL) {
 			return NULL;
 		}
@@ -292,7 +542,7 @@ service_alloc(void *ud, void *ptr, size_t osize, size_t nsize) {
 		if (osize > nsize && check_limit(stat)) {
 			return NULL;
 		}
-		void * ret = realloc(ptr, nsize);
+		void * ret = stat->arena ? arena_realloc(stat->arena, ptr, osize, nsize) : realloc(ptr, nsize);
 		if (ret == NULL)
 			return NULL;
 		stat->mem += nsize;
@@ -329,9 +579,16 @@ error_message(lua_State *fromL, lua_State *toL, const char *msg) {
 int
 service_init(struct service_pool *p, service_id id, void *ud, size_t sz, void *pL) {
 	struct service *S = get_service(p, id);
-	assert(S != NULL && S->L == NULL && S->status == SERVICE_STATUS_UNINITIALIZED);
+	assert(S != NULL && S->L == NULL && atomic_int_load(&S->h->status) == SERVICE_STATUS_UNINITIALIZED);
 	lua_State *L;
 	memset(&S->stat, 0, sizeof(S->stat));
+	if (p->arena) {
+		S->stat.arena = arena_new();
+		if (S->stat.arena == NULL) {
+			error_message(NULL, pL, "New arena error");
+			return 1;
+		}
+	}
 	L = lua_newstate(service_alloc, &S->stat);
 	if (L == NULL)
 		return 1;
@@ -343,12 +600,18 @@ service_init(struct service_pool *p, service_id id, void *ud, size_t sz, void *p
 		lua_close(L);
 		return 1;
 	}
-	S->msg = queue_new_ptr(p->queue_length);
-	if (S->msg == NULL) {
+	S->h->msg = mailbox_new(p->queue_init, p->queue_length);
+	if (S->h->msg == NULL) {
 		error_message(NULL, pL, "New queue error");
 		lua_close(L);
 		return 1;
 	}
+	S->h->out = outbox_new(p->outbox_length);
+	if (S->h->out == NULL) {
+		error_message(NULL, pL, "New outbox error");
+		lua_close(L);
+		return 1;
+	}
 	S->L = L;
 	S->rL = lua_newthread(L);
 	luaL_ref(L, LUA_REGISTRYINDEX);
@@ -376,6 +639,15 @@ service_memcount(struct service_pool *p, service_id id, int luatype) {
 	return S->stat.count[type];
 }
 
+int
+service_mailbox_stat(struct service_pool *p, service_id id, struct mailbox_stat *stat) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL || h->msg == NULL)
+		return 1;
+	mailbox_stat(h->msg, stat);
+	return 0;
+}
+
 static int
 require_cmodule(lua_State *L) {
 	const char *name = (const char *)lua_touserdata(L, 1);
@@ -429,7 +701,7 @@ service_close(struct service_pool *p, service_id id) {
 			lua_close(s->L);
 			s->L = NULL;
 		}
-		s->status = SERVICE_STATUS_DEAD;
+		atomic_int_store(&s->h->status, SERVICE_STATUS_DEAD);
 	}
 }
 
@@ -437,8 +709,24 @@ void
 service_delete(struct service_pool *p, service_id id) {
 	struct service * s = get_service(p, id);
 	if (s) {
-		*service_slot(p, id.id) = NULL;
+		atomic_int_store(&s->h->status, SERVICE_STATUS_DEAD);
+		// wait for the workers pushing messages to it, see service_push_message()
+		while (atomic_int_load(&s->h->ref) != 0) {
+			sys_yield();
+		}
+		// Nobody can get it by id now, but the slot can't be reused before free_service()
+		unsigned int slot = id.id & p->mask;
+		spinlock_acquire(&p->lock);
+		p->in_free[slot] |= SLOT_FREEING;
+		s->h->id.id = 0;
+		spinlock_release(&p->lock);
 		free_service(s);
+		// The next service in this slot has a new id
+		spinlock_acquire(&p->lock);
+		p->generation[slot] = (id.id >> p->shift) + 1;
+		p->in_free[slot] &= ~SLOT_FREEING;
+		free_slot(p, slot);
+		spinlock_release(&p->lock);
 	}
 }
 
@@ -448,12 +736,13 @@ service_loadstring(struct service_pool *p, service_id id, const char *source, si
 	if (S == NULL || S->L == NULL)
 		return "Init service first";
 	lua_State *L = S->L;
-	if (luaL_loadbuffer(L, source, source_sz, chunkname) != LUA_OK) {
+	// All the services are loaded from the same source usually, compile it only once.
+	if (chunkcache_load(L, source, source_sz, chunkname) != LUA_OK) {
 		const char * r = lua_tostring(S->L, -1);
-		S->status = SERVICE_STATUS_DEAD;
+		atomic_int_store(&S->h->status, SERVICE_STATUS_DEAD);
 		return r;
 	}
-	S->status = SERVICE_STATUS_IDLE;
+	atomic_int_store(&S->h->status, SERVICE_STATUS_IDLE);
 	return NULL;
 }
 
@@ -490,67 +779,212 @@ service_resume(struct service_pool *p, service_id id) {
 	return 1;
 }
 
+static inline int
+pushable(int status) {
+	return status != SERVICE_STATUS_UNINITIALIZED && status != SERVICE_STATUS_DEAD;
+}
+
+// Pin the service before touching it from other workers. Returns NULL if it doesn't exist.
+static inline struct service_hot *
+pin_service(struct service_pool *p, service_id id) {
+	struct service_hot *h = &p->hot[id.id & p->mask];
+	atomic_int_inc(&h->ref);
+	// service_delete() marks DEAD before waiting for ref, so check status first, and then id.
+	if (!pushable(atomic_int_load(&h->status)) || h->id.id != id.id) {
+		atomic_int_dec(&h->ref);
+		return NULL;
+	}
+	return h;
+}
+
+static inline void
+unpin_service(struct service_hot *h) {
+	atomic_int_dec(&h->ref);
+}
+
 int
 service_push_message(struct service_pool *p, service_id id, struct message *msg) {
-	struct service *s = get_service(p, id);
-	if (s == NULL || s->status == SERVICE_STATUS_DEAD)
+	struct service_hot *h = pin_service(p, id);
+	if (h == NULL)
 		return -1;
-	if (queue_push_ptr(s->msg, msg)) {
-		// blocked
+	// Don't overtake the parked messages
+	int r = atomic_int_load(&h->parked) ? 1 : mailbox_push(h->msg, msg);
+	unpin_service(h);
+	// 1 : blocked
+	return r;
+}
+
+// Calling with park_lock
+static int
+park_reserve(struct service *s) {
+	int n = atomic_int_load(&s->h->parked);
+	if (n < s->park_cap)
+		return 0;
+	int cap = s->park_cap ? s->park_cap * 2 : 16;
+	struct message **park = (struct message **)malloc(cap * sizeof(struct message *));
+	if (park == NULL)
 		return 1;
+	int i;
+	for (i=0;i<n;i++) {
+		park[i] = s->park[(s->park_head + i) % s->park_cap];
+	}
+	free(s->park);
+	s->park = park;
+	s->park_head = 0;
+	s->park_cap = cap;
+	return 0;
+}
+
+// Calling with park_lock, 0 succ
+static int
+block_sender(struct service *s, service_id sender) {
+	int n = atomic_int_load(&s->blocked_n);
+	int i;
+	for (i=0;i<n;i++) {
+		if (s->blocked[i].id == sender.id)
+			return 0;
+	}
+	if (n >= s->blocked_cap) {
+		int cap = s->blocked_cap ? s->blocked_cap * 2 : 4;
+		service_id *blocked = (service_id *)realloc(s->blocked, cap * sizeof(service_id));
+		if (blocked == NULL)
+			return 1;
+		s->blocked = blocked;
+		s->blocked_cap = cap;
 	}
+	s->blocked[n] = sender;
+	atomic_int_store(&s->blocked_n, n + 1);
 	return 0;
 }
 
 int
-service_status_get(struct service_pool *p, service_id id) {
+service_park_message(struct service_pool *p, service_id id, struct message *msg, service_id sender) {
+	struct service_hot *h = pin_service(p, id);
+	if (h == NULL)
+		return -1;
+	struct service *s = *service_slot(p, id.id);
+	int r = 0;
+	spinlock_acquire(&s->park_lock);
+	int n = atomic_int_load(&s->h->parked);
+	if (n == 0 && mailbox_push(s->h->msg, msg) == 0) {
+		r = 0;
+	} else if (sender.id != SERVICE_ID_SYSTEM && n >= p->queue_length) {
+		// Too many parked messages, the sender waits for MESSAGE_UNBLOCK
+		r = block_sender(s, sender) ? -2 : 2;
+	} else if (park_reserve(s)) {
+		r = -2;
+	} else {
+		s->park[(s->park_head + n) % s->park_cap] = msg;
+		atomic_int_store(&s->h->parked, n + 1);
+		r = 1;
+	}
+	spinlock_release(&s->park_lock);
+	unpin_service(h);
+	return r;
+}
+
+// Move the parked messages into the mailbox, calling by the service itself
+static void
+unpark_messages(struct service *s) {
+	spinlock_acquire(&s->park_lock);
+	int n = atomic_int_load(&s->h->parked);
+	int i;
+	for (i=0;i<n;i++) {
+		if (mailbox_push(s->h->msg, s->park[s->park_head]))
+			break;
+		s->park_head = (s->park_head + 1) % s->park_cap;
+	}
+	atomic_int_store(&s->h->parked, n - i);
+	spinlock_release(&s->park_lock);
+}
+
+int
+service_blocked_senders(struct service_pool *p, service_id id, service_id *senders, int n, int all) {
 	struct service *s = get_service(p, id);
-	if (s == NULL)
+	if (s == NULL || atomic_int_load(&s->blocked_n) == 0)
+		return 0;
+	spinlock_acquire(&s->park_lock);
+	int blocked_n = atomic_int_load(&s->blocked_n);
+	if (!all && atomic_int_load(&s->h->parked) >= p->queue_length) {
+		n = 0;
+	} else if (n > blocked_n) {
+		n = blocked_n;
+	}
+	memcpy(senders, s->blocked + blocked_n - n, n * sizeof(service_id));
+	atomic_int_store(&s->blocked_n, blocked_n - n);
+	spinlock_release(&s->park_lock);
+	return n;
+}
+
+int
+service_wakeup(struct service_pool *p, service_id id, int *sockevent) {
+	*sockevent = -1;
+	struct service_hot *h = pin_service(p, id);
+	if (h == NULL)
+		return 0;
+	int status = SERVICE_STATUS_IDLE;
+	int r = atomic_compare_exchange_strong(&h->status, &status, SERVICE_STATUS_SCHEDULE);
+	if (!r)
+		*sockevent = h->sockevent_id;
+	unpin_service(h);
+	return r;
+}
+
+int
+service_status_get(struct service_pool *p, service_id id) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return SERVICE_STATUS_DEAD;
-	return s->status;	
+	return atomic_int_load(&h->status);
 }
 
 void
 service_status_set(struct service_pool *p, service_id id, int status) {
-	struct service *s = get_service(p, id);
-	if (s == NULL)
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return;
-	s->status = status;
+	atomic_int_store(&h->status, status);
 }
 
 struct message *
-service_message_out(struct service_pool *p, service_id id) {
-	struct service *s = get_service(p, id);
-	if (s == NULL)
+service_message_out(struct service_pool *p, service_id id, int *receipt) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL || h->out == NULL)
 		return NULL;
-	struct message * r = s->out;
-	if (r)
-		s->out = NULL;
-	return r;
+	struct outbox *o = h->out;
+	if (o->out_head == o->out_tail)
+		return NULL;
+	struct outbox_slot *slot = &o->out[o->out_head++ & (o->size - 1)];
+	*receipt = slot->receipt;
+	return slot->msg;
 }
 
 int
-service_send_message(struct service_pool *p, service_id id, struct message *msg) {
-	struct service *s = get_service(p, id);
-	if (s == NULL || s->out != NULL)
+service_send_message(struct service_pool *p, service_id id, struct message *msg, int receipt) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL || h->out == NULL || outbox_full(h->out))
 		return 1;
-	s->out = msg;
+	struct outbox *o = h->out;
+	struct outbox_slot *slot = &o->out[o->out_tail++ & (o->size - 1)];
+	slot->msg = msg;
+	slot->receipt = receipt;
 	return 0;
 }
 
 void
 service_write_receipt(struct service_pool *p, service_id id, int receipt, struct message *bounce) {
 	struct service *s = get_service(p, id);
-	if (s != NULL && s->receipt == MESSAGE_RECEIPT_NONE) {
-		s->receipt = receipt;
+	if (s != NULL && s->h->receipt == MESSAGE_RECEIPT_NONE) {
+		s->h->receipt = receipt;
+		s->bounce = bounce;
+	} else if (s != NULL) {
+		fprintf(stderr, "WARNING: write receipt %d fail (%d)\n", id.id, s->h->receipt);
+		message_delete(s->bounce);
+		s->h->receipt = receipt;
 		s->bounce = bounce;
 	} else {
-		fprintf(stderr, "WARNING: write receipt %d fail (%d)\n", id.id, s->receipt);
-		if (s) {
-			message_delete(s->bounce);
-			s->receipt = receipt;
-			s->bounce = bounce;
-		}
+		// The service is gone, nobody reads the bounce
+		message_delete(bounce);
 	}
 }
 
@@ -561,13 +995,41 @@ service_read_receipt(struct service_pool *p, service_id id, int *receipt) {
 		*receipt = MESSAGE_RECEIPT_NONE;
 		return NULL;
 	}
-	*receipt = s->receipt;
+	*receipt = s->h->receipt;
 	struct message *r = s->bounce;
-	s->receipt = MESSAGE_RECEIPT_NONE;
+	s->h->receipt = MESSAGE_RECEIPT_NONE;
 	s->bounce = NULL;
 	return r;
 }
 
+void
+service_write_bounce(struct service_pool *p, service_id id, int receipt, struct message *bounce) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL || h->out == NULL) {
+		message_delete(bounce);
+		return;
+	}
+	struct outbox *o = h->out;
+	// Can't overflow, see outbox_full()
+	assert(o->bounce_tail - o->bounce_head < o->size);
+	struct outbox_slot *slot = &o->bounce[o->bounce_tail++ & (o->size - 1)];
+	slot->msg = bounce;
+	slot->receipt = receipt;
+}
+
+struct message *
+service_read_bounce(struct service_pool *p, service_id id, int *receipt) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL || h->out == NULL)
+		return NULL;
+	struct outbox *o = h->out;
+	if (o->bounce_head == o->bounce_tail)
+		return NULL;
+	struct outbox_slot *slot = &o->bounce[o->bounce_head++ & (o->size - 1)];
+	*receipt = slot->receipt;
+	return slot->msg;
+}
+
 struct message *
 service_pop_message(struct service_pool *p, service_id id) {
 	struct service *s = get_service(p, id);
@@ -578,27 +1040,30 @@ service_pop_message(struct service_pool *p, service_id id) {
 		s->bounce = NULL;
 		return r;
 	}
-	return queue_pop_ptr(s->msg);
+	if (atomic_int_load(&s->h->parked))
+		unpark_messages(s);
+	return mailbox_pop(s->h->msg);
 }
 
 int
 service_has_message(struct service_pool *p, service_id id) {
-	struct service *s = get_service(p, id);
-	if (s == NULL)
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return 0;
-	if (s->receipt != MESSAGE_RECEIPT_NONE) {
+	if (h->receipt != MESSAGE_RECEIPT_NONE) {
 		return 1;
 	}
-	return queue_length(s->msg) > 0;
+	if (h->out && h->out->bounce_head != h->out->bounce_tail) {
+		return 1;
+	}
+	return mailbox_length(h->msg) > 0 || atomic_int_load(&h->parked) > 0;
 }
 
 void
 service_send_signal(struct service_pool *p, service_id id) {
 	struct service *s = get_service(p, id);
-	if (s == NULL)
+	if (s == NULL || s->h->out == NULL)
 		return;
-	if (s->out)
-		message_delete(s->out);
 	struct message msg;
 	msg.from = id;
 	msg.to.id = SERVICE_ID_ROOT;
@@ -607,7 +1072,13 @@ service_send_signal(struct service_pool *p, service_id id) {
 	msg.msg = NULL;
 	msg.sz = 0;
 
-	s->out = message_new(&msg);
+	// The signal must be the last message, the pending messages in the outbox are sent before it.
+	struct outbox *o = s->h->out;
+	// Can't overflow, outbox_full() keeps one slot for it
+	assert(o->out_tail - o->out_head + o->bounce_tail - o->bounce_head < o->size);
+	struct outbox_slot *slot = &o->out[o->out_tail++ & (o->size - 1)];
+	slot->msg = message_new(&msg);
+	slot->receipt = 0;
 }
 
 struct strbuff {
@@ -714,34 +1185,58 @@ service_cpucost(struct service_pool *p, service_id id) {
 	return S->cpucost + systime_thread() - S->clock;
 }
 
-int
-service_binding_get(struct service_pool *p, service_id id) {
+uint64_t
+service_resume_cost(struct service_pool *p, service_id id) {
 	struct service *S= get_service(p, id);
 	if (S == NULL)
+		return 0;
+	return systime_thread() - S->clock;
+}
+
+int
+service_binding_get(struct service_pool *p, service_id id) {
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return -1;
-	return S->binding_thread;
+	return h->binding_thread;
 }
 
 void
 service_binding_set(struct service_pool *p, service_id id, int worker_thread) {
-	struct service *S= get_service(p, id);
-	if (S == NULL)
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return;
-	S->binding_thread = worker_thread;
+	h->binding_thread = worker_thread;
 }
 
 int
 service_sockevent_get(struct service_pool *p, service_id id) {
-	struct service *S= get_service(p, id);
-	if (S == NULL)
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
 		return -1;
-	return S->sockevent_id;
+	return h->sockevent_id;
 }
 
 void
 service_sockevent_init(struct service_pool *p, service_id id, int index) {
-	struct service *S= get_service(p, id);
+	struct service_hot *h = get_hot(p, id);
+	if (h == NULL)
+		return;
+	h->sockevent_id = index;
+}
+
+int
+service_reactor_get(struct service_pool *p, service_id id) {
+	struct service *S = get_service(p, id);
+	if (S == NULL)
+		return 0;
+	return S->reactor;
+}
+
+void
+service_reactor_set(struct service_pool *p, service_id id) {
+	struct service *S = get_service(p, id);
 	if (S == NULL)
 		return;
-	S->sockevent_id = index;
+	S->reactor = 1;
 }
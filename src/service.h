@@ -41,24 +41,45 @@ void service_delete(struct service_pool *p, service_id id);
 const char * service_loadstring(struct service_pool *p, service_id id, const char *source, size_t source_sz, const char *chunkname);
 // 0 yield , 1 term or error
 int service_resume(struct service_pool *p, service_id id);
-// 0 succ, 1 blocked, -1 not exist
+// 0 succ, 1 blocked, -1 not exist. Thread safe, any worker can push messages.
 int service_push_message(struct service_pool *p, service_id id, struct message *msg);
+// 0 pushed, 1 parked in the waiter list of the service (the mailbox is full), -1 not exist, -2 out of memory.
+// 2 blocked : the waiter list is full (as the mailbox), msg is not taken, and sender is recorded in the service.
+// The messages from SERVICE_ID_SYSTEM (sender) are never blocked.
+// The parked messages are moved into the mailbox in order when the service pops messages. Thread safe.
+int service_park_message(struct service_pool *p, service_id id, struct message *msg, service_id sender);
+// Takes at most n blocked senders of the service, when it has fewer parked messages than the limit (or all is true).
+// Returns the number of senders, they should be notified (MESSAGE_UNBLOCK) to send again.
+int service_blocked_senders(struct service_pool *p, service_id id, service_id *senders, int n, int all);
+// Thread safe. 1 if the service changes from IDLE to SCHEDULE, otherwise returns its sockevent (or -1)
+int service_wakeup(struct service_pool *p, service_id id, int *sockevent);
 struct message * service_pop_message(struct service_pool *p, service_id id);
 int service_has_message(struct service_pool *p, service_id id);
 int service_status_get(struct service_pool *p, service_id id);
 void service_status_set(struct service_pool *p, service_id id, int status);
-// 0 succ
-int service_send_message(struct service_pool *p, service_id id, struct message *msg);
-struct message * service_message_out(struct service_pool *p, service_id id);
+// 0 succ, 1 outbox is full. receipt : 1 if the sender waits for the receipt
+int service_send_message(struct service_pool *p, service_id id, struct message *msg, int receipt);
+struct message * service_message_out(struct service_pool *p, service_id id, int *receipt);
 void service_write_receipt(struct service_pool *p, service_id id, int receipt, struct message *bounce);
 struct message * service_read_receipt(struct service_pool *p, service_id id, int *receipt);
+// receipts of the messages nobody waits for (only failures)
+void service_write_bounce(struct service_pool *p, service_id id, int receipt, struct message *bounce);
+struct message * service_read_bounce(struct service_pool *p, service_id id, int *receipt);
 size_t service_memlimit(struct service_pool *p, service_id id, size_t limit);
 size_t service_memcount(struct service_pool *p, service_id id, int luatype);
+struct mailbox_stat;
+// Calling by the service itself. 0 succ
+int service_mailbox_stat(struct service_pool *p, service_id id, struct mailbox_stat *stat);
 int service_backtrace(struct service_pool *p, service_id id, char *buf, size_t sz);
 uint64_t service_cpucost(struct service_pool *p, service_id id);
+// cpu time since the last resume
+uint64_t service_resume_cost(struct service_pool *p, service_id id);
 int service_binding_get(struct service_pool *p, service_id id);
 void service_binding_set(struct service_pool *p, service_id id, int worker_thread);
 int service_sockevent_get(struct service_pool *p, service_id id);
 void service_sockevent_init(struct service_pool *p, service_id id, int index);
+// Set by the service itself when it waits a fd, see reactor_drop()
+int service_reactor_get(struct service_pool *p, service_id id);
+void service_reactor_set(struct service_pool *p, service_id id);
 
 #endif
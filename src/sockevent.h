@@ -31,6 +31,11 @@ sockevent_initsocket() {
 #include <unistd.h>
 #include <fcntl.h>
 
+#if defined(__linux__)
+#include <sys/eventfd.h>
+#include <stdint.h>
+#endif
+
 typedef int socket_t;
 static const socket_t socket_invalid = -1;
 
@@ -54,6 +59,7 @@ struct sockevent {
 	// 这是一个 socket_t 类型的数组，包含两个元素，通常用于创建一个双向通信的管道（或双端口套接字对）。
 	//	在事件通知系统中，一个端口用于写入数据（触发事件），另一个端口用于读取数据（监听事件）。
 	//	这种设计可以在跨线程或跨进程的场景下，实现事件的通知和传递。
+	//	在 Linux 下 pipe[0] 是一个 eventfd ，读写的是一个计数器，pipe[1] 不使用。
 	socket_t pipe[2];
 
 	// atomic_int 类型的字段，用于表示当前事件状态。这一字段采用原子操作来进行状态更新，保证了多线程访问的安全性。
@@ -81,6 +87,48 @@ sockevent_close(struct sockevent *e) {
 	}
 }
 
+#if defined(__linux__)
+
+// One eventfd per event, no loopback connection is needed.
+
+static inline int
+sockevent_open(struct sockevent *e) {
+	if (e->pipe[0] != socket_invalid)
+		return 0;
+	// The counter starts from 1, the same as the first byte sent by the socket version.
+	e->pipe[0] = eventfd(1, EFD_CLOEXEC);
+	e->pipe[1] = socket_invalid;
+	if (e->pipe[0] < 0) {
+		e->pipe[0] = socket_invalid;
+		return -1;
+	}
+	atomic_int_init(&e->e, 0);
+	return 0;
+}
+
+static inline void
+sockevent_trigger(struct sockevent *e) {
+	if (e->pipe[0] == socket_invalid)
+		return;
+	if (atomic_int_load(&e->e))
+		return;
+
+	atomic_int_store(&e->e, 1);
+	uint64_t one = 1;
+	ssize_t r = write(e->pipe[0], &one, sizeof(one));
+	(void)r;
+}
+
+static inline int
+sockevent_wait(struct sockevent *e) {
+	uint64_t n;
+	int r = (int)read(e->pipe[0], &n, sizeof(n));
+	atomic_int_store(&e->e, 0);
+	return r;
+}
+
+#else
+
 static inline int
 sockevent_open(struct sockevent *e) {
 	if (e->pipe[0] != socket_invalid)
@@ -166,6 +214,8 @@ sockevent_wait(struct sockevent *e) {
 	return r;
 }
 
+#endif
+
 static inline socket_t
 sockevent_fd(struct sockevent *e) {
 	return e->pipe[0];
@@ -5,23 +5,29 @@
 #include <assert.h>
 #include <errno.h>
 #include <time.h>
+#include <sched.h>
 
 void
 sys_init() {
 }
 
 void
-sys_sleep(unsigned int msec) {
+sys_usleep(uint64_t usec) {
 	struct timespec timeout;
 	int rc;
-	timeout.tv_sec  = msec / 1000;
-	timeout.tv_nsec = (msec % 1000) * 1000 * 1000;
+	timeout.tv_sec  = usec / 1000000;
+	timeout.tv_nsec = (usec % 1000000) * 1000;
 	do
 		rc = nanosleep(&timeout, &timeout);
 	while (rc == -1 && errno == EINTR);
 	assert(rc == 0);
 }
 
+void
+sys_yield() {
+	sched_yield();
+}
+
 #else
 
 #include <windows.h>
@@ -107,14 +113,14 @@ static void hrtimer_end() {
 }
 
 void
-sys_sleep(unsigned int msec) {
+sys_usleep(uint64_t usec) {
 	HANDLE timer = CreateWaitableTimerExW(NULL, NULL, support_hrtimer ? CREATE_WAITABLE_TIMER_HIGH_RESOLUTION : 0, TIMER_ALL_ACCESS);
 	if (!timer) {
 		return;
 	}
 	hrtimer_start();
 	LARGE_INTEGER time;
-	time.QuadPart = -((long long)msec * 10000);
+	time.QuadPart = -((long long)usec * 10);
 	if (SetWaitableTimer(timer, &time, 0, NULL, NULL, 0)) {
 		WaitForSingleObject(timer, INFINITE);
 	}
@@ -122,4 +128,14 @@ sys_sleep(unsigned int msec) {
 	hrtimer_end();
 }
 
+void
+sys_yield() {
+	SwitchToThread();
+}
+
 #endif
+
+void
+sys_sleep(unsigned int msec) {
+	sys_usleep((uint64_t)msec * 1000);
+}
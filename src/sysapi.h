@@ -3,7 +3,13 @@
 
 void sys_init();
 
-// sleep n 1/100s
-void sys_sleep(unsigned int csec);
+#include <stdint.h>
+
+// sleep n 1/1000s
+void sys_sleep(unsigned int msec);
+// sleep n 1/1000000s
+void sys_usleep(uint64_t usec);
+// give up the cpu to the other threads
+void sys_yield();
 
 #endif
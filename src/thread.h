@@ -11,6 +11,12 @@ static void thread_join(void *handle, int n);
 static void * thread_run(struct thread thread);
 static void thread_wait(void *pid);
 
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
 #if defined(_MSC_VER) || defined(__MINGW32__) || defined(__MINGW64__)
 
 #include <windows.h>
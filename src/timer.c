@@ -1,12 +1,14 @@
 #include "spinlock.h"
 #include "systime.h"
 #include "timer.h"
+#include "atomic.h"
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <inttypes.h>
+#include <assert.h>
 
 #define TIME_NEAR_SHIFT 8
 #define TIME_NEAR (1 << TIME_NEAR_SHIFT)	// 其值为 2^8 = 256。这个常量表示在时间管理中，近期的时间范围 (在这个实现里，是25.6ms)
@@ -15,6 +17,11 @@
 #define TIME_NEAR_MASK (TIME_NEAR-1)		// 其值为 255。这是一个掩码，用于提取时间值的低 8 位，以判断某个时间是否在近期的时间段内。
 #define TIME_LEVEL_MASK (TIME_LEVEL-1)		// 其值为 63。这是一个掩码，用于提取时间值的低 6 位，以判断某个时间值属于哪个时间层级。
 
+// The nodes are allocated in chunks and reused, the index of a node in chunks is a part of the handle.
+#define TIMER_CHUNK_SHIFT 8
+#define TIMER_CHUNK (1 << TIMER_CHUNK_SHIFT)
+#define TIMER_MAXCHUNK 4096	// 1M timers
+
 
 /*
 	ps： 阅读脉络
@@ -52,6 +59,37 @@ struct timer_node {
 
 	// 一个无符号 32 位整数，表示定时器的到期时间。这个时间通常以某个基准时间（如当前时间）为参考，指示该定时器何时应该被触发
 	uint32_t expire;
+
+	// 节点在节点池中的序号，和版本号一起组成 timer_add 返回的句柄。
+	uint32_t index;
+
+	// 节点所属的插入缓冲区，分发后归还到那里。
+	int buffer;
+
+	// 版本号 << 1 | 取消标记。timer_cancel 用 CAS 设置取消标记；分发时版本号加一并清除标记，旧的句柄随之失效。
+	atomic_uint state;
+
+	// 分发时从 state 取出的取消标记，只有定时器线程使用。
+	int cancel;
+};
+
+// Each worker adds the timers into its own buffer, the ticking thread merges them into the wheel.
+struct timer_buffer {
+	// 新加入的节点（无锁 MPSC 栈），定时器线程整个取走。
+	CACHE_LINE_ALIGN atomic_ptr add;
+	// 定时器线程归还的已分发节点。
+	atomic_ptr recycle;
+	// 只有拥有者使用的空闲节点。
+	struct timer_node *freelist;
+};
+
+// A node with its payload
+struct timer_slot {
+	struct timer_node node;
+	union {
+		uint8_t data[TIMER_PAYLOAD];
+		uint64_t align;
+	} u;
 };
 
 
@@ -86,9 +124,12 @@ struct timer {
 	// 一个二维数组，存储按时间级别分组的定时器链表。这个结构允许快速查找和管理不同时间段内的定时器。TIME_LEVEL:64
 	struct link_list t[4][TIME_LEVEL];
 
-	// 自旋锁，用于确保对 timer 结构体的线程安全访问。在多线程环境中，自旋锁可以防止数据竞争。
+	// 自旋锁，只用于节点池扩容和共享的插入缓冲区。时间轮只由定时器线程（调用 timer_update 的线程）访问。
 	struct spinlock lock;
 
+	// 保护共享的插入缓冲区的空闲节点
+	struct spinlock shared_lock;
+
 	// 这个time 在timer_shift()中不断+1， 它和current字段类似，但是总是相对的滞后于current字段。
 	uint32_t time;
 
@@ -102,6 +143,28 @@ struct timer {
 	// 自系统启动以来的时间值。 timer_init()中初始化
 	uint64_t current_point;
 
+	// 每秒的 tick 数，即定时器的精度。默认 100 （10ms）。
+	uint32_t frequency;
+
+	// systime_counter() 的频率
+	uint64_t counter_frequency;
+
+	// 定时器线程睡眠时为 1 ，wait_expire 是它醒来的时间（tick）。更早到期的 timer_add 需要唤醒它。
+	atomic_int waiting;
+	atomic_uint wait_expire;
+
+	// T->time 的副本，timer_add 用它计算到期时间。
+	atomic_uint now;
+
+	// 插入缓冲区，每个工作线程一个，最后一个是其它线程共享的（用 lock 保护）。
+	struct timer_buffer *buffer;
+	int buffer_n;
+	void *buffer_ptr;
+
+	// 节点池：每个 chunk 有 TIMER_CHUNK 个节点，chunk 一旦分配就不会移动，timer_cancel 可以无锁访问。
+	struct timer_slot *chunk[TIMER_MAXCHUNK];
+	atomic_int chunk_n;
+
 	// 指向定时器到期时调用的回调函数的指针。用户可以定义自己的处理函数，以在定时器到期时执行特定操作。
 	timer_execute_func func;
 
@@ -192,28 +255,170 @@ add_node(struct timer *T,struct timer_node *node) {
 	sz ： 用户提供的数据大小；
 	time ：待触发的一个时间段， 单位应该也是0.11
 */
-void
-timer_add(struct timer *T,void *arg, size_t sz, int time) {
-	// 分配内存以容纳定时器节点及其附加的数据
-	struct timer_node *node = (struct timer_node *)malloc(sizeof(*node) + sz);
+static inline struct timer_node *
+slot_node(struct timer *T, uint32_t index) {
+	return &T->chunk[index >> TIMER_CHUNK_SHIFT][index & (TIMER_CHUNK - 1)].node;
+}
+
+static inline void
+list_push(atomic_ptr *list, struct timer_node *node) {
+	struct timer_node *head;
+	do {
+		head = (struct timer_node *)atomic_ptr_load(list);
+		node->next = head;
+	} while (!atomic_ptr_cas(list, head, node));
+}
+
+static inline struct timer_node *
+list_take(atomic_ptr *list) {
+	return (struct timer_node *)atomic_exchange(list, (uintptr_t)0);
+}
+
+// Add a chunk of nodes into the freelist of the buffer
+static int
+node_grow(struct timer *T, int buffer) {
+	struct timer_slot *c = (struct timer_slot *)malloc(TIMER_CHUNK * sizeof(*c));
+	if (c == NULL)
+		return 1;
+	spinlock_acquire(&T->lock);
+	int n = atomic_int_load(&T->chunk_n);
+	if (n >= TIMER_MAXCHUNK) {
+		spinlock_release(&T->lock);
+		free(c);
+		return 1;
+	}
+	struct timer_buffer *b = &T->buffer[buffer];
+	uint32_t base = (uint32_t)n << TIMER_CHUNK_SHIFT;
+	int i;
+	for (i=TIMER_CHUNK-1;i>=0;i--) {
+		struct timer_node *node = &c[i].node;
+		node->index = base + i;
+		node->buffer = buffer;
+		atomic_init(&node->state, 1 << 1);
+		node->next = b->freelist;
+		b->freelist = node;
+	}
+	T->chunk[n] = c;
+	atomic_int_store(&T->chunk_n, n + 1);
+	spinlock_release(&T->lock);
+	return 0;
+}
+
+// Calling by the owner of the buffer
+static inline struct timer_node *
+node_alloc(struct timer *T, int buffer) {
+	struct timer_buffer *b = &T->buffer[buffer];
+	if (b->freelist == NULL) {
+		b->freelist = list_take(&b->recycle);
+		if (b->freelist == NULL && node_grow(T, buffer))
+			return NULL;
+	}
+	struct timer_node *node = b->freelist;
+	b->freelist = node->next;
+	return node;
+}
+
+// Put a list of nodes back to their buffers, calling by the ticking thread
+static inline void
+node_free(struct timer *T, struct timer_node *list) {
+	while (list) {
+		struct timer_node *next = list->next;
+		list_push(&T->buffer[list->buffer].recycle, list);
+		list = next;
+	}
+}
+
+int
+timer_add(struct timer *T, int buffer, void *arg, size_t sz, int time, uint64_t *handle) {
+	assert(sz <= TIMER_PAYLOAD);
+	int shared = buffer < 0 || buffer >= T->buffer_n - 1;
+	if (shared) {
+		// The threads other than workers share the last buffer
+		buffer = T->buffer_n - 1;
+		spinlock_acquire(&T->shared_lock);
+	}
+
+	// 从本线程的节点池中取一个节点
+	struct timer_node *node = node_alloc(T, buffer);
+	if (shared)
+		spinlock_release(&T->shared_lock);
+	if (node == NULL) {
+		if (handle)
+			*handle = 0;
+		return 0;
+	}
 
 	// 将用户提供的 arg 数据复制到 node 的后面（node + 1 处）。
 		// 这样，节点结构体后面紧跟着的是用户数据
 		// 后续就可以使用node + 1 得到用户数据的指针， 即在dispatch_list()中看到过的current+1 使用方式。
 	memcpy(node + 1,arg,sz);
-
-	//  获取自旋锁，确保在修改定时器状态时不会有其他线程干扰。
-	spinlock_acquire(&T->lock);
+	if (handle) {
+		// The low 32bits is never 0
+		uint32_t version = atomic_load(&node->state) >> 1;
+		*handle = (uint64_t)version << 32 | (node->index + 1);
+	}
 
 	//  设置定时器节点的到期时间。这个到期时间是基于当前的 T->time 加上传入的 time 参数，确保定时器能够在预期的时间后触发.
-		// T->time 在上面已经说明过了，它是一个时间计数器，以100微秒为单位，即0.1ms。
-	node->expire = time + T->time;
+	uint32_t expire = time + atomic_load(&T->now);
+	node->expire = expire;
 
-	// 将新的定时器节点添加到定时器管理的链表中
-	add_node(T, node);
+	// 放入插入缓冲区，定时器线程稍后把它加入时间轮，之后不能再访问 node
+	list_push(&T->buffer[buffer].add, node);
 
-	// 释放自旋锁，允许其他线程访问定时器。
-	spinlock_release(&T->lock);
+	if (atomic_int_load(&T->waiting)
+		&& (int32_t)(expire - atomic_load(&T->wait_expire)) < 0
+		&& atomic_exchange(&T->waiting, 0)) {
+		return 1;
+	}
+	return 0;
+}
+
+int
+timer_cancel(struct timer *T, uint64_t handle) {
+	uint32_t index = (uint32_t)handle - 1;
+	uint32_t version = (uint32_t)(handle >> 32);
+	if (index >= ((uint32_t)atomic_int_load(&T->chunk_n) << TIMER_CHUNK_SHIFT))
+		return 0;
+	struct timer_node *node = slot_node(T, index);
+	unsigned int state = version << 1;
+	// It's still in the wheel (or the buffer), drop it when it expires
+	return atomic_compare_exchange_strong(&node->state, &state, state | 1);
+}
+
+// Move the nodes in the buffers into the wheel, calling by the ticking thread
+static void
+timer_merge(struct timer *T) {
+	int i;
+	for (i=0;i<T->buffer_n;i++) {
+		struct timer_node *list = list_take(&T->buffer[i].add);
+		// reverse the list to keep the order of timer_add
+		struct timer_node *r = NULL;
+		while (list) {
+			struct timer_node *next = list->next;
+			list->next = r;
+			r = list;
+			list = next;
+		}
+		while (r) {
+			struct timer_node *next = r->next;
+			if ((int32_t)(r->expire - T->time) < 0) {
+				// expired before merging, dispatch it at next tick
+				r->expire = T->time;
+			}
+			add_node(T, r);
+			r = next;
+		}
+	}
+}
+
+static int
+timer_pending(struct timer *T) {
+	int i;
+	for (i=0;i<T->buffer_n;i++) {
+		if (atomic_ptr_load(&T->buffer[i].add))
+			return 1;
+	}
+	return 0;
 }
 
 /*
@@ -291,15 +496,31 @@ timer_shift(struct timer *T) {
 	}
 }
 
+// Invalidate the handles of the nodes before dispatch, and take the cancel flag
+static inline void
+expire_list(struct timer_node *current) {
+	while (current) {
+		unsigned int state = atomic_load(&current->state);
+		while (!atomic_compare_exchange_weak(&current->state, &state, ((state >> 1) + 1) << 1)) {}
+		current->cancel = state & 1;
+		current = current->next;
+	}
+}
+
 /*
 	负责遍历并处理一组timer_node。
-	它通过调用用户指定的回调函数来执行相关操作，同时确保在处理后释放节点的内存。
+	它通过调用用户指定的回调函数来执行相关操作，节点稍后由调用者放回节点池。
 	
 	timer_execute_func函数指针：typedef void (*timer_execute_func)(void *ud,void *arg);
 */
 static inline void
 dispatch_list(struct timer_node *current, timer_execute_func func, void *ud) {
 	do {
+		// 已经取消的定时器
+		if (current->cancel) {
+			current = current->next;
+			continue;
+		}
 		// 调用用户提供的回调函数 func，传入的参数是 ud 和 (void *)(current + 1)。
 			// 这里 current + 1 的作用是将指针向后移动一个位置，以访问定时器节点中的有效数据（假设有效数据存储在节点后面）。
 			/*
@@ -313,14 +534,8 @@ dispatch_list(struct timer_node *current, timer_execute_func func, void *ud) {
 			*/
 		func(ud, (void *)(current + 1));
 
-		// 先保存当前节点的指针，以便在处理完后释放。
-		struct timer_node * temp = current;
-
 		// 更新 current 指向下一个定时器节点，以继续遍历
 		current = current->next;
-
-		// 在处理完当前节点后，释放其内存，防止内存泄漏
-		free(temp);	
 	} while (current);
 }
 
@@ -337,18 +552,13 @@ timer_execute(struct timer *T, timer_execute_func func, void *ud) {
 
 		// 将表头取出来，然后将链表清空； 这个表头current后面就挂着原链表。
 		struct timer_node *current = link_clear(&T->n[idx]);
+		expire_list(current);
 
-		// 释放自旋锁，以允许其他线程或操作访问定时器。这个步骤是为了避免在调用处理函数时持有锁，从而提高效率。
-		spinlock_release(&T->lock);
-
-		// dispatch_list don't need lock T
 		// 调用 dispatch_list 函数处理获取的到期定时器节点。func 和 ud 是用户提供的参数。
 		dispatch_list(current, func, ud);
 
-		// 在处理完当前到期的定时器后，重新获取自旋锁，为接下来的操作做好准备。
-		spinlock_acquire(&T->lock);
-
-		// 继续检查链表非空， ps：释放自旋锁后，可能有新的快到期的timer_node插入进来，需要及时处理。
+		// 节点归还到各自的插入缓冲区
+		node_free(T, current);
 	}
 }
 
@@ -357,8 +567,7 @@ timer_execute(struct timer *T, timer_execute_func func, void *ud) {
 */
 static void 
 timer_update_tick(struct timer *T, timer_execute_func func, void *ud) {
-	//  用于确保在多线程环境中，其他线程在处理定时器时不会修改其状态，从而避免数据竞争和不一致性。
-	spinlock_acquire(&T->lock); 
+	// 时间轮只由定时器线程访问，不需要加锁；其它线程添加的定时器在 timer_merge() 中加入。
 
 	// 首先尝试执行任何超时为 0 的定时器事件。这种情况较少见，但在某些场景下可能会发生，例如定时器刚好到期时。
 	// try to dispatch timeout 0 (rare condition)
@@ -370,9 +579,6 @@ timer_update_tick(struct timer *T, timer_execute_func func, void *ud) {
 
 	// 再次检查并执行到期的定时器事件。这次调用是确保在时间移动后能处理所有到期的定时器。
 	timer_execute(T, func, ud);
-
-	// 在所有处理完成后，释放自旋锁，允许其他线程访问定时器。
-	spinlock_release(&T->lock);
 }
 
 /*
@@ -402,6 +608,11 @@ timer_new() {
 
 	// 初始化自旋锁
 	spinlock_init(&r->lock); 
+	spinlock_init(&r->shared_lock);
+	atomic_int_init(&r->waiting, 0);
+	atomic_init(&r->wait_expire, 0);
+	atomic_init(&r->now, 0);
+	atomic_int_init(&r->chunk_n, 0);
 
 	// current填0， 稍后马上会被更新
 	r->current = 0;	
@@ -410,13 +621,6 @@ timer_new() {
 	return r;	
 }
 
-static void
-timer_release_func(void *ud, void *arg) {
-	// do nothing
-	(void)ud;
-	(void)arg;
-}
-
 /*
 	函数负责清理和释放定时器资源，确保系统能够正确地释放所有相关的内存和资源
 */
@@ -426,42 +630,30 @@ timer_destroy(struct timer *T) {
 	if (T == NULL)
 		return;
 
-	// 获取定时器的锁，确保线程安全
-	spinlock_acquire(&T->lock);
-
-	// 清理 TIME_NEAR 数组中的定时器节点
-	int i,j;
-	for (i=0;i<TIME_NEAR;i++) {
-		// 清空链表并获取当前节点
-		struct timer_node *current = link_clear(&T->n[i]);
-		if (current) {
-			// 调用释放函数
-			dispatch_list(current, timer_release_func, NULL);
-		}
+	// 所有的节点都在节点池的 chunk 中，直接释放 chunk
+	int i;
+	int n = atomic_int_load(&T->chunk_n);
+	for (i=0;i<n;i++) {
+		free(T->chunk[i]);
 	}
-
-	// 清理 TIME_LEVEL 数组中的定时器节点
-	for (i=0;i<4;i++) {
-		for (j=0;j<TIME_LEVEL;j++) {
-			// 清空链表并获取当前节点
-			struct timer_node *current = link_clear(&T->t[i][j]);
-			if (current) {
-				// 调用释放函数
-				dispatch_list(current, timer_release_func, NULL);
-			}
-		}
-	}
-
-	// 释放定时器的锁
-	spinlock_release(&T->lock);
+	free(T->buffer_ptr);
 
 	// 销毁定时器的锁
 	spinlock_destroy(&T->lock);
+	spinlock_destroy(&T->shared_lock);
 
 	// 释放定时器结构体的内存
 	free(T);
 }
 
+// Monotonic time in tick
+static uint64_t
+timer_mono(struct timer *TI) {
+	uint64_t c = systime_counter();
+	uint64_t f = TI->counter_frequency;
+	return c / f * TI->frequency + c % f * TI->frequency / f;
+}
+
 /*
 	timer_update 函数用于更新定时器的状态并处理定时器到期的事件
 	func: 回调函数
@@ -469,8 +661,11 @@ timer_destroy(struct timer *T) {
 */
 void
 timer_update(struct timer *TI, timer_execute_func func, void *ud) {
-	// 获取自系统启动以来的经过的时间值， 以100微秒（即0.1ms）为单位
-	uint64_t cp = systime_mono();
+	// 把各线程新加的定时器加入时间轮
+	timer_merge(TI);
+
+	// 获取自系统启动以来的经过的时间值，以 tick 为单位
+	uint64_t cp = timer_mono(TI);
 
 	if(cp < TI->current_point) {
 		// 说明系统时间回退了，这通常是由于系统时间被调整或重启。此时打印错误信息，并更新 current_point 为当前时间。
@@ -494,7 +689,53 @@ timer_update(struct timer *TI, timer_execute_func func, void *ud) {
 			timer_update_tick(TI, func, ud);
 		}
 		// 经过这个循环后， T->time = T->time + diff, 所以说，T->time 总是相对的滞后于T->current。
+		atomic_store(&TI->now, TI->time);
+	}
+}
+
+// Ticks from T->time to the next non-empty slot, or to the end of the near slots (the far slots shift there).
+// The slot of T->time (timeout 0) is dispatched at the next tick, so it's at least 1.
+static uint32_t
+next_expire(struct timer *T) {
+	uint32_t ct = T->time;
+	if (T->n[ct & TIME_NEAR_MASK].head.next)
+		return 1;
+	uint32_t i;
+	for (i=1;i<TIME_NEAR;i++) {
+		uint32_t t = ct + i;
+		if ((t & TIME_NEAR_MASK) == 0 || T->n[t & TIME_NEAR_MASK].head.next)
+			return i;
 	}
+	return TIME_NEAR;
+}
+
+// Monotonic tick to systime_counter()
+static uint64_t
+tick_counter(struct timer *TI, uint64_t tick) {
+	uint64_t f = TI->counter_frequency;
+	return tick / TI->frequency * f + (tick % TI->frequency * f + TI->frequency - 1) / TI->frequency;
+}
+
+uint64_t
+timer_wait_time(struct timer *TI, uint64_t maxtime) {
+	timer_merge(TI);
+	uint32_t n = next_expire(TI);
+	atomic_store(&TI->wait_expire, TI->time + n);
+	atomic_int_store(&TI->waiting, 1);
+	// timer_add() before setting waiting doesn't trigger
+	if (timer_pending(TI)) {
+		atomic_int_store(&TI->waiting, 0);
+		return 0;
+	}
+	// T->time is at TI->current_point, the next tick of T->time + n begins at TI->current_point + n
+	uint64_t wakeup = tick_counter(TI, TI->current_point + n);
+	uint64_t now = systime_counter();
+	if (wakeup <= now)
+		return 0;
+	uint64_t f = TI->counter_frequency;
+	uint64_t d = wakeup - now;
+	uint64_t usec = d / f * 1000000 + (d % f * 1000000 + f - 1) / f;
+	return usec < maxtime ? usec : maxtime;
 }
 
 uint32_t
@@ -507,13 +748,31 @@ timer_now(struct timer *TI) {
 	return TI->current;
 }
 
+uint32_t
+timer_frequency(struct timer *TI) {
+	return TI->frequency;
+}
+
 /*
 	timer_init 函数用于初始化一个新的定时器实例
 */
 struct timer *
-timer_init() {
+timer_init(uint32_t frequency, int nbuffer) {
 	// 创建新的定时器实例
 	struct timer *TI = timer_new();	
+	TI->frequency = frequency;
+
+	// one more buffer shared by the other threads
+	TI->buffer_n = nbuffer + 1;
+	TI->buffer_ptr = malloc(TI->buffer_n * sizeof(struct timer_buffer) + CACHE_LINE_SIZE - 1);
+	TI->buffer = (struct timer_buffer *)(((uintptr_t)TI->buffer_ptr + CACHE_LINE_SIZE - 1) & ~(uintptr_t)(CACHE_LINE_SIZE - 1));
+	int i;
+	for (i=0;i<TI->buffer_n;i++) {
+		atomic_ptr_init(&TI->buffer[i].add, NULL);
+		atomic_ptr_init(&TI->buffer[i].recycle, NULL);
+		TI->buffer[i].freelist = NULL;
+	}
+	TI->counter_frequency = systime_frequency();
 	
 	// 系统当前时间（毫秒）
 	uint64_t walltime = systime_wall(); 
@@ -538,11 +797,11 @@ timer_init() {
 
 		那么 current的最大值为99 ， 在这里的计算它的用处是啥？
 	*/
-	TI->current = walltime % 100;	
+	TI->current = walltime % 100 * frequency / 100;	
 
-	// 获取自系统启动以来的高精度时间，同样，以0.1ms为单位
+	// 获取自系统启动以来的单调时间，同样，以 tick 为单位
 		// 单调时间通常用于计时器，因为它不会受系统时间调整的影响。
-	TI->current_point = systime_mono();
+	TI->current_point = timer_mono(TI);
 
 	return TI;
 }
@@ -2,6 +2,10 @@
 #define ltask_timer_h
 
 #include <stdint.h>
+#include <stddef.h>
+
+// Max size of the user data of a timer node
+#define TIMER_PAYLOAD 16
 
 /*
  导读：
@@ -13,22 +17,35 @@ struct timer;
 
 typedef void (*timer_execute_func)(void *ud,void *arg);
 
-// 初始化一个定时器
-struct timer * timer_init();
+// 初始化一个定时器，frequency 为每秒的 tick 数（精度），nbuffer 为插入缓冲区的数量（工作线程数）
+struct timer * timer_init(uint32_t frequency, int nbuffer);
 
 // 销毁一个定时器
 void timer_destroy(struct timer *T);
 
-// 
+// in tick
 uint64_t timer_now(struct timer *TI);
 
+// ticks per second
+uint32_t timer_frequency(struct timer *TI);
+
 //
 uint32_t timer_starttime(struct timer *TI);
 
 //
 void timer_update(struct timer *TI, timer_execute_func func, void *ud);
 
-// 添加一个新的定时器节点
-void timer_add(struct timer *T,void *arg,size_t sz,int time);
+// 添加一个新的定时器节点，time 以 tick 为单位，sz 不能超过 TIMER_PAYLOAD
+// buffer is the worker id of caller, [0, nbuffer). The other threads use -1 .
+// The node is merged into the wheel by the thread calling timer_update() / timer_wait_time() later.
+// *handle is for timer_cancel(), it's 0 if out of memory.
+// returns 1 if it expires before the time returned by the last timer_wait_time(), the waiting thread should be triggered.
+int timer_add(struct timer *T,int buffer,void *arg,size_t sz,int time,uint64_t *handle);
+
+// 取消一个定时器，returns 1 if succ, 0 if it has been dispatched (or cancelled).
+int timer_cancel(struct timer *T, uint64_t handle);
+
+// Call after timer_update(), returns the time (in 1/1000000s) until the next expiry, but no more than maxtime.
+uint64_t timer_wait_time(struct timer *T, uint64_t maxtime);
 
 #endif
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include "debuglog.h"
 #include "cond.h"
 #include "systime.h"
+#include "deque.h"
+#include "bitmap.h"
 
 struct ltask;
 
@@ -27,11 +29,33 @@ struct binding_service {
 	service_id q[BINDING_SERVICE_QUEUE];
 };
 
+// 所有工作线程共享的状态位图，调度器只遍历置位的线程，而不是扫描全部线程。
+// 位图只是提示，使用者仍然要检查线程本身的字段。各个位图由不同的线程修改，所以各自独占 cache line 。
+// 正在运行服务的线程由 busy 字段判断，不需要位图：调度器只关心其中 service_ready 不为 0 (不在 free 中) 的线程。
+struct worker_map {
+	// service_done 不为 0 的线程。
+	CACHE_LINE_ALIGN struct bitmap done;
+	// service_ready 为 0 的线程。先清位再写 service_ready ，取走 service_ready 后再置位。
+	CACHE_LINE_ALIGN struct bitmap free;
+	// waiting 不为 0 的线程，只有调度器修改。
+	CACHE_LINE_ALIGN struct bitmap waiting;
+};
+
+static inline void
+worker_map_init(struct worker_map *m) {
+	bitmap_init(&m->done);
+	bitmap_init(&m->free);
+	bitmap_init(&m->waiting);
+}
+
 // worker_thread 结构体用于定义 Ltask 系统中的工作线程
 struct worker_thread {
 	// 指向 ltask 的指针，用于关联线程与其所管理的任务系统
 	struct ltask *task;
 
+	// 指向所有工作线程共享的状态位图
+	struct worker_map *map;
+
 	// （在 DEBUGLOG 定义下可用）：指向调试日志记录器 debug_logger 的指针，仅在启用调试模式下存在。用于记录线程调试信息
 #ifdef DEBUGLOG
 	struct debug_logger *logger;
@@ -45,10 +69,6 @@ struct worker_thread {
 	service_id binding;
 	service_id waiting;
 
-	// 原子类型的整数，分别用于标识服务是否就绪和完成。原子操作确保在多线程环境下的线程安全。
-	atomic_int service_ready;
-	atomic_int service_done;
-
 	// 线程的终止信号标志，通常用于指示线程是否需要结束
 	int term_signal;
 
@@ -67,11 +87,26 @@ struct worker_thread {
 
 	// 线程的调度时间戳，类型为 uint64_t，记录最后一次调度的时间，用于控制调度频率或性能分析。
 	uint64_t schedule_time;
+
+	// 本线程的运行队列，存放本线程唤醒的（没有绑定的）服务。完成一个服务后不必获取调度器，直接从这里取下一个；
+	// 空闲的线程从其它线程的队列顶部窃取。
+	struct deque local;
+
+	// 连续从本地队列（含窃取）取出的服务数量，超过 LOCAL_BATCH 后要回到全局调度队列，避免饿死其它服务。
+	int local_batch;
+
+	// 原子类型的整数，分别用于标识服务是否就绪和完成。原子操作确保在多线程环境下的线程安全。
+	// 调度器轮询它们而工作线程会 CAS 修改，所以各自独占一条 cache line，避免伪共享。
+	// 整个 worker_thread 数组需要按 CACHE_LINE_SIZE 对齐分配。
+	CACHE_LINE_ALIGN atomic_int service_ready;
+	CACHE_LINE_ALIGN atomic_int service_done;
 };
 
 static inline void
-worker_init(struct worker_thread *worker, struct ltask *task, int worker_id) {
+worker_init(struct worker_thread *worker, struct ltask *task, struct worker_map *map, int worker_id) {
 	worker->task = task;
+	worker->map = map;
+	bitmap_set(&map->free, worker_id);
 #ifdef DEBUGLOG
 	worker->logger = dlog_new("WORKER", worker_id);
 #endif
@@ -88,6 +123,8 @@ worker_init(struct worker_thread *worker, struct ltask *task, int worker_id) {
 	worker->busy = 0;
 	worker->binding_queue.head = 0;
 	worker->binding_queue.tail = 0;
+	deque_init(&worker->local);
+	worker->local_batch = 0;
 }
 
 static inline int
@@ -136,6 +173,19 @@ worker_destory(struct worker_thread *worker) {
 	cond_release(&worker->trigger);
 }
 
+// Calling by Scheduler, set service_ready without checking
+static inline void
+worker_set_ready(struct worker_thread *worker, service_id id) {
+	bitmap_clear(&worker->map->free, worker->worker_id);
+	atomic_int_store(&worker->service_ready, id.id);
+}
+
+// Calling by Worker
+static inline void
+worker_set_busy(struct worker_thread *worker, int busy) {
+	worker->busy = busy;
+}
+
 // Calling by Scheduler. 0 : succ
 static inline int
 worker_binding_job(struct worker_thread *worker, service_id id) {
@@ -161,6 +211,7 @@ worker_assign_job(struct worker_thread *worker, service_id id) {
 				q->head = q->tail = 0;
 		}
 		// only one producer (Woker) except itself (worker_steal_job), so don't need use CAS to set
+		bitmap_clear(&worker->map->free, worker->worker_id);
 		worker->service_ready = id.id;
 		return id;
 	} else {
@@ -178,6 +229,7 @@ worker_get_job(struct worker_thread *worker) {
 		int job = worker->service_ready;
 		if (job) {
 			if (atomic_int_cas(&worker->service_ready, job, 0)) {
+				bitmap_set(&worker->map->free, worker->worker_id);
 				id.id = job;
 				break;
 			}
@@ -201,6 +253,7 @@ worker_steal_job(struct worker_thread *worker, struct service_pool *p) {
 			return id;
 		}
 		if (atomic_int_cas(&worker->service_ready, job, 0)) {
+			bitmap_set(&worker->map->free, worker->worker_id);
 			id = t;
 			worker->waiting.id = 0;
 		}
@@ -208,6 +261,26 @@ worker_steal_job(struct worker_thread *worker, struct service_pool *p) {
 	return id;
 }
 
+// Calling by Worker, schedule a service woken by itself. 0 : succ
+static inline int
+worker_push_local(struct worker_thread *worker, service_id id) {
+	return deque_push(&worker->local, (int)id.id);
+}
+
+// Calling by Worker
+static inline service_id
+worker_pop_local(struct worker_thread *worker) {
+	service_id id = { deque_pop(&worker->local) };
+	return id;
+}
+
+// Calling by other Workers, the local queue never has binding services
+static inline service_id
+worker_steal_local(struct worker_thread *worker) {
+	service_id id = { deque_steal(&worker->local) };
+	return id;
+}
+
 // Calling by Scheduler, may consume service_done
 static inline service_id
 worker_done_job(struct worker_thread *worker) {
@@ -224,6 +297,7 @@ worker_done_job(struct worker_thread *worker) {
 static inline int
 worker_complete_job(struct worker_thread *worker) {
 	if (atomic_int_cas(&worker->service_done, 0, worker->running.id)) {
+		bitmap_set(&worker->map->done, worker->worker_id);
 		worker->running.id = 0;
 		return 0;
 	}
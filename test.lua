@@ -1,7 +1,28 @@
 local start = require "test.start"
+
+-- The reactor (epoll) is linux only
+local function is_linux()
+    if package.config:sub(1,1) ~= "/" then
+        return false
+    end
+    local f = io.popen "uname -s"
+    if not f then
+        return false
+    end
+    local os = f:read "l"
+    f:close()
+    return os == "Linux"
+end
+
 start {
     core = {
         debuglog = "=", -- stdout
+        worker = 4, -- test/mailbox.lua and test/park.lua hold a worker while the sender runs in another one
+        reactor = is_linux(),
+        io_thread = 2,
+        queue = 1024, -- see test/mailbox.lua
+        max_service = 256, -- see test/recycle.lua
+        chunkcache = 1024 * 1024, -- see test/chunkcache.lua
     },
     service_path = "service/?.lua;test/?.lua",
     bootstrap = {
@@ -0,0 +1,10 @@
+local ltask = require "ltask"
+
+-- Run test/bench_<name>.lua one by one
+local names = { ... }
+
+for _, name in ipairs(names) do
+	local addr = ltask.spawn("bench_" .. name)
+	ltask.call(addr, "run")
+	ltask.syscall(addr, "quit")
+end
@@ -0,0 +1,49 @@
+-- Service churn : spawn and quit services over and over. Run with max_service=256 to recycle the slots sooner.
+local ltask = require "ltask"
+
+local role = ...
+
+local S = {}
+
+function S.ping()
+end
+
+if role == "child" then
+	return S
+end
+
+local ROUNDS <const> = 64
+local BATCH <const> = 64
+
+function S.run()
+	local t = ltask.counter()
+	for _ = 1, ROUNDS do
+		local tasks = {}
+		for i = 1, BATCH do
+			tasks[i] = { ltask.spawn, "bench_churn", "child" }
+		end
+		local children = {}
+		for _, resp in ltask.parallel(tasks) do
+			if resp.error then
+				resp:rethrow()
+			end
+			children[#children+1] = resp[1]
+		end
+		for i = 1, #children do
+			tasks[i] = { ltask.call, children[i], "ping" }
+		end
+		for _, resp in ltask.parallel(tasks) do
+			if resp.error then
+				resp:rethrow()
+			end
+		end
+		for i = 1, #children do
+			ltask.syscall(children[i], "quit")
+		end
+	end
+	t = ltask.counter() - t
+	local n = ROUNDS * BATCH
+	print(string.format("Churn : %d services in %.3fs, %.0f/s", n, t, n / t))
+end
+
+return S
@@ -0,0 +1,77 @@
+-- Message throughput : pairs of services, each sender sends messages to its receiver without waiting.
+local ltask = require "ltask"
+
+local role, main, n = ...
+
+local S = {}
+
+if role == "receiver" then
+	local count = 0
+
+	function S.msg()
+		count = count + 1
+		if count == n then
+			count = 0
+			ltask.send(main, "done")
+		end
+	end
+
+	return S
+end
+
+if role == "sender" then
+	function S.start(peer, data)
+		for _ = 1, n do
+			ltask.send(peer, "msg", data)
+		end
+	end
+
+	return S
+end
+
+local PAIRS <const> = 64
+local MESSAGES <const> = 16384
+
+local finished = 0
+local token = {}
+
+function S.done()
+	finished = finished + 1
+	if finished == PAIRS then
+		ltask.wakeup(token)
+	end
+end
+
+-- The payload is stored in the message header if it's small, see MESSAGE_INLINE
+local function bench(sender, receiver, size)
+	local data = string.rep("x", size)
+	finished = 0
+	local t = ltask.counter()
+	for i = 1, PAIRS do
+		ltask.send(sender[i], "start", receiver[i], data)
+	end
+	if finished < PAIRS then
+		ltask.wait(token)
+	end
+	t = ltask.counter() - t
+	local total = PAIRS * MESSAGES
+	print(string.format("Message (%d bytes) : %d in %.3fs, %.0f/s", size, total, t, total / t))
+end
+
+function S.run()
+	local self = ltask.self()
+	local sender = {}
+	local receiver = {}
+	for i = 1, PAIRS do
+		receiver[i] = ltask.spawn("bench_message", "receiver", self, MESSAGES)
+		sender[i] = ltask.spawn("bench_message", "sender", self, MESSAGES)
+	end
+	bench(sender, receiver, 8)
+	bench(sender, receiver, 1024)
+	for i = 1, PAIRS do
+		ltask.syscall(sender[i], "quit")
+		ltask.syscall(receiver[i], "quit")
+	end
+end
+
+return S
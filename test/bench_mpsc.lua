@@ -0,0 +1,72 @@
+-- Throughput of one receiver with 1/4/16/64 senders
+local ltask = require "ltask"
+
+local role, collector, n = ...
+
+if role == "producer" then
+	ltask.call(collector, "ready")
+	for _ = 1, n do
+		ltask.send(collector, "push")
+	end
+	return
+end
+
+local TOTAL <const> = 256 * 1024
+
+local S = {}
+
+local producer = 0
+local waiting = 0
+local count = 0
+local expect = 0
+local start_time
+local done = {}
+
+function S.ready()
+	waiting = waiting + 1
+	if waiting == producer then
+		-- start all the senders at the same time
+		start_time = ltask.counter()
+		ltask.multi_wakeup "ready"
+	else
+		ltask.multi_wait "ready"
+	end
+end
+
+function S.push()
+	count = count + 1
+	if count == expect then
+		ltask.wakeup(done)
+	end
+end
+
+local function bench(p)
+	local self = ltask.self()
+	local n = TOTAL // p
+	producer = p
+	waiting = 0
+	count = 0
+	expect = n * p
+	local tasks = {}
+	for i = 1, p do
+		tasks[i] = { ltask.spawn, "bench_mpsc", "producer", self, n }
+	end
+	ltask.fork(function ()
+		for _, resp in ltask.parallel(tasks) do
+			if resp.error then
+				resp:rethrow()
+			end
+		end
+	end)
+	ltask.wait(done)
+	local ti = ltask.counter() - start_time
+	print(string.format("MPSC %2d senders : %d messages in %.3fs, %.0f msg/s", p, expect, ti, expect / ti))
+end
+
+function S.run()
+	for _, p in ipairs { 1, 4, 16, 64 } do
+		bench(p)
+	end
+end
+
+return S
@@ -0,0 +1,144 @@
+// Queue microbench : P producer threads push pointers to one consumer thread, without the scheduler.
+// mpsc : all the producers push into one queue_new_mpsc_ptr().
+// spsc : the baseline, a queue_new_ptr() ring allows only one writer, so each producer has its own ring
+//        and the consumer polls them in turn.
+// Build with "make bench_queue", and run "./bench_queue [total]"
+
+#include "queue.h"
+#include "systime.h"
+#include "sysapi.h"
+#include "thread.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+
+#define QUEUE_SIZE 4096
+#define MAX_PRODUCER 64
+
+struct bench {
+	int producer;
+	int n;
+	// mpsc : q[0] is shared by all the producers
+	int mpsc;
+	struct queue *q[MAX_PRODUCER];
+	atomic_int ready;
+};
+
+struct producer {
+	struct bench *b;
+	int id;
+};
+
+// producer id in high bits, sequence in low bits, never NULL
+static inline void *
+make_value(int id, int i) {
+	return (void *)(((uintptr_t)id << 32 | (uintptr_t)i) + 1);
+}
+
+static void
+producer_thread(void *ud) {
+	struct producer *p = (struct producer *)ud;
+	struct bench *b = p->b;
+	struct queue *q = b->mpsc ? b->q[0] : b->q[p->id];
+	atomic_int_inc(&b->ready);
+	while (atomic_int_load(&b->ready) <= b->producer)
+		sys_yield();
+	int i;
+	for (i=0;i<b->n;i++) {
+		void *v = make_value(p->id, i);
+		while (queue_push_ptr(q, v)) {
+			// full
+			sys_yield();
+		}
+	}
+}
+
+static void
+consumer_thread(void *ud) {
+	struct bench *b = (struct bench *)ud;
+	int last[MAX_PRODUCER];
+	int i;
+	for (i=0;i<b->producer;i++) {
+		last[i] = -1;
+	}
+	int total = b->producer * b->n;
+	int nq = b->mpsc ? 1 : b->producer;
+	int index = 0;
+	while (atomic_int_load(&b->ready) < b->producer)
+		sys_yield();
+	// start
+	atomic_int_inc(&b->ready);
+	while (total > 0) {
+		int idle = 1;
+		for (i=0;i<nq;i++) {
+			struct queue *q = b->q[index];
+			index = (index + 1) % nq;
+			void *v = queue_pop_ptr(q);
+			if (v) {
+				uintptr_t x = (uintptr_t)v - 1;
+				int id = (int)(x >> 32);
+				int seq = (int)(x & 0xffffffff);
+				// the messages from one producer keep the order
+				assert(last[id] + 1 == seq);
+				last[id] = seq;
+				--total;
+				idle = 0;
+				break;
+			}
+		}
+		if (idle)
+			sys_yield();
+	}
+}
+
+static double
+run(int producer, int n, int mpsc) {
+	struct bench b;
+	b.producer = producer;
+	b.n = n;
+	b.mpsc = mpsc;
+	atomic_int_init(&b.ready, 0);
+	int i;
+	int nq = mpsc ? 1 : producer;
+	for (i=0;i<nq;i++) {
+		b.q[i] = mpsc ? queue_new_mpsc_ptr(QUEUE_SIZE) : queue_new_ptr(QUEUE_SIZE);
+	}
+	struct producer p[MAX_PRODUCER];
+	struct thread t[MAX_PRODUCER + 1];
+	t[0].func = consumer_thread;
+	t[0].ud = &b;
+	for (i=0;i<producer;i++) {
+		p[i].b = &b;
+		p[i].id = i;
+		t[i+1].func = producer_thread;
+		t[i+1].ud = &p[i];
+	}
+	uint64_t start = systime_counter();
+	void *handle = thread_start(t, producer + 1, 0);
+	thread_join(handle, producer + 1);
+	uint64_t ti = systime_counter() - start;
+	for (i=0;i<nq;i++) {
+		queue_delete(b.q[i]);
+	}
+	return (double)ti / systime_frequency();
+}
+
+int
+main(int argc, char *argv[]) {
+	int total = argc > 1 ? atoi(argv[1]) : 1 << 22;
+	static const int producers[] = { 1, 4, 16, 64 };
+	int i;
+	for (i=0;i<sizeof(producers)/sizeof(producers[0]);i++) {
+		int producer = producers[i];
+		int n = total / producer;
+		int mpsc;
+		for (mpsc=0;mpsc<2;mpsc++) {
+			double t = run(producer, n, mpsc);
+			printf("%s %2d producers : %d in %.3fs, %.0f/s\n",
+				mpsc ? "mpsc" : "spsc", producer, n * producer, t, n * producer / t);
+		}
+	}
+	return 0;
+}
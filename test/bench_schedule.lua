@@ -0,0 +1,53 @@
+-- Scheduling rate : pairs of services call each other, each call schedules both of them once.
+local ltask = require "ltask"
+
+local role, peer, n = ...
+
+local S = {}
+
+function S.ping()
+end
+
+if role == "pong" then
+	return S
+end
+
+if role == "ping" then
+	function S.start()
+		for _ = 1, n do
+			ltask.call(peer, "ping")
+		end
+	end
+	return S
+end
+
+local PAIRS <const> = 256
+local CALLS <const> = 4096
+
+function S.run()
+	local ping = {}
+	local pong = {}
+	for i = 1, PAIRS do
+		pong[i] = ltask.spawn("bench_schedule", "pong")
+		ping[i] = ltask.spawn("bench_schedule", "ping", pong[i], CALLS)
+	end
+	local tasks = {}
+	for i = 1, PAIRS do
+		tasks[i] = { ltask.call, ping[i], "start" }
+	end
+	local t = ltask.counter()
+	for _, resp in ltask.parallel(tasks) do
+		if resp.error then
+			resp:rethrow()
+		end
+	end
+	t = ltask.counter() - t
+	local n = PAIRS * CALLS * 2
+	print(string.format("Schedule : %d times in %.3fs, %.0f/s", n, t, n / t))
+	for i = 1, PAIRS do
+		ltask.syscall(ping[i], "quit")
+		ltask.syscall(pong[i], "quit")
+	end
+end
+
+return S
@@ -0,0 +1,35 @@
+-- Timer jitter : how late ltask.sleep wakes up, at the tick set by .timer_resolution
+local ltask = require "ltask"
+
+local S = {}
+
+local N <const> = 200
+
+local function jitter(ti)
+	local expect = ti / 100	-- ltask.sleep takes 1/100s
+	local total = 0
+	local max = 0
+	for _ = 1, N do
+		local t = ltask.counter()
+		ltask.sleep(ti)
+		local late = ltask.counter() - t - expect
+		total = total + late
+		if late > max then
+			max = late
+		end
+	end
+	print(string.format("Sleep %gms : late %.3fms on average, %.3fms at most", expect * 1000, total / N * 1000, max * 1000))
+end
+
+function S.run()
+	local resolution = ltask.timer_resolution()
+	print(string.format("Timer resolution %dus", resolution))
+	for _, ti in ipairs { 0.01, 0.1, 1, 5 } do
+		-- ltask.sleep rounds up to the next tick
+		if ti * 10000 >= resolution then
+			jitter(ti)
+		end
+	end
+end
+
+return S
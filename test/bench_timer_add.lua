@@ -0,0 +1,62 @@
+-- Many services arm timers at the same time
+local ltask = require "ltask"
+
+local role, n = ...
+
+local S = {}
+
+if role == "arm" then
+	local fired = 0
+	local done = {}
+	local function count()
+		fired = fired + 1
+		if fired == n then
+			ltask.wakeup(done)
+		end
+	end
+
+	-- returns the time of arming n timers
+	function S.arm(ti)
+		fired = 0
+		local t = ltask.counter()
+		for _ = 1, n do
+			ltask.timeout(ti, count)
+		end
+		t = ltask.counter() - t
+		ltask.wait(done)
+		return t
+	end
+
+	return S
+end
+
+local SERVICE <const> = 64
+local TIMER <const> = 4096
+
+function S.run()
+	local addr = {}
+	for i = 1, SERVICE do
+		addr[i] = ltask.spawn("bench_timer_add", "arm", TIMER)
+	end
+	local tasks = {}
+	for i = 1, SERVICE do
+		tasks[i] = { ltask.call, addr[i], "arm", 50 }
+	end
+	local t = ltask.counter()
+	local arm = 0
+	for _, resp in ltask.parallel(tasks) do
+		if resp.error then
+			resp:rethrow()
+		end
+		arm = arm + resp[1]
+	end
+	t = ltask.counter() - t
+	local n = SERVICE * TIMER
+	print(string.format("Timer add : %d services arm %d timers, %.0f/s per service, all fired in %.3fs",
+		SERVICE, n, TIMER / (arm / SERVICE), t))
+	for i = 1, SERVICE do
+		ltask.syscall(addr[i], "quit")
+	end
+end
+
+return S
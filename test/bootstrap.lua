@@ -81,4 +81,22 @@ for req, resp in ltask.parallel(task) do
 	print(table.unpack(resp, 1, resp.n))
 end
 
+-- test/<name>.lua provides S.run(), it raises an error if the test fails
+local function run_test(name, ...)
+	local addr = ltask.spawn(name, ...)
+	ltask.call(addr, "run")
+	ltask.syscall(addr, "quit")
+	print("Test", name, "passed")
+end
+
+run_test "mpsc"
+run_test "mailbox"
+run_test "park"
+run_test "pingpong"
+run_test "forward"
+run_test "fileio"
+run_test "waitfd"
+run_test "recycle"
+run_test "chunkcache"
+
 print "Bootstrap End"
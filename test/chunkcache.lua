@@ -0,0 +1,57 @@
+-- The services loading the same file share the compiled chunk, and the cache never grows past its limit.
+local ltask = require "ltask"
+
+local role = ...
+
+local S = {}
+
+if role == "child" then
+	return S
+end
+
+local function loadfile_stat(filename)
+	local s = ltask.chunkcache_stat()
+	local f = assert(ltask.loadfile(filename))
+	f()
+	local r = ltask.chunkcache_stat()
+	return r.hit - s.hit, r.miss - s.miss
+end
+
+function S.run()
+	-- The service source and this file are cached already
+	local N <const> = 16
+	local s = ltask.chunkcache_stat()
+	for _ = 1, N do
+		local addr = ltask.spawn("chunkcache", "child")
+		ltask.syscall(addr, "quit")
+	end
+	local r = ltask.chunkcache_stat()
+	assert(r.hit - s.hit >= N * 2, "The chunks are not shared")
+	assert(r.miss == s.miss, "The same source is compiled again")
+
+	-- Each file takes about half of the cache (the source and the bytecode)
+	local size = r.limit // 4
+	local files = {}
+	for i = 1, 4 do
+		local filename = os.tmpname()
+		local f = assert(io.open(filename, "wb"))
+		f:write("return '", string.rep(tostring(i), size), "'")
+		f:close()
+		files[i] = filename
+		local hit, miss = loadfile_stat(filename)
+		assert(hit == 0 and miss == 1)
+		r = ltask.chunkcache_stat()
+		assert(r.bytes <= r.limit, "The cache is too large")
+	end
+	local hit, miss = loadfile_stat(files[4])
+	assert(hit == 1 and miss == 0, "The last one is evicted")
+	hit, miss = loadfile_stat(files[1])
+	assert(hit == 0 and miss == 1, "The least recently used one isn't evicted")
+	for i = 1, #files do
+		os.remove(files[i])
+	end
+	r = ltask.chunkcache_stat()
+	print("Chunkcache", r.n, "chunks", r.bytes, "bytes", "hit", r.hit, "miss", r.miss)
+end
+
+return S
@@ -0,0 +1,30 @@
+-- ltask.io runs in the io threads
+local ltask = require "ltask"
+
+local S = {}
+
+function S.run()
+	local filename = os.tmpname()
+	local fd = assert(ltask.io.open(filename, "w"))
+	assert(ltask.io.write(fd, "Hello") == 5)
+	assert(ltask.io.write(fd, "World", 10) == 5)
+	assert(ltask.io.fsync(fd))
+	assert(ltask.io.close(fd))
+
+	fd = assert(ltask.io.open(filename, "r"))
+	assert(ltask.io.read(fd, 5) == "Hello")
+	assert(ltask.io.read(fd, 5) == "\0\0\0\0\0")
+	assert(ltask.io.read(fd, 100) == "World")
+	assert(ltask.io.read(fd, 100) == "")	-- end of file
+	assert(ltask.io.read(fd, 3, 11) == "orl")
+	assert(not pcall(ltask.io.read, fd, -1))
+	assert(not pcall(ltask.io.read, fd, 0x80000000))
+	assert(ltask.io.close(fd))
+	os.remove(filename)
+
+	local r, err, errno = ltask.io.open(filename, "r")
+	assert(r == nil and type(err) == "string" and errno > 0)
+	print "File io"
+end
+
+return S
@@ -0,0 +1,50 @@
+-- A proxy forwards some requests to the backend, the backend responds to the caller directly.
+local ltask = require "ltask"
+
+local role, backend = ...
+
+local S = {}
+
+if role == "backend" then
+	function S.echo(...)
+		return ltask.self(), ...
+	end
+
+	return S
+end
+
+if role == "proxy" then
+	ltask.forward_handler(function (from, session, msg, sz)
+		if ltask.unpack(msg, sz) == "echo" then
+			return backend
+		end
+	end)
+
+	function S.ping()
+		return "PONG"
+	end
+
+	return S
+end
+
+function S.run()
+	local b = ltask.spawn("forward", "backend")
+	local p = ltask.spawn("forward", "proxy", b)
+	local addr, v = ltask.call(p, "echo", "hello")
+	assert(addr == b and v == "hello")
+	assert(ltask.call(p, "ping") == "PONG")
+	-- Many forwarded requests at the same time
+	local tasks = {}
+	for i = 1, 100 do
+		tasks[i] = { ltask.call, p, "echo", i }
+	end
+	for req, resp in ltask.parallel(tasks) do
+		assert(resp[2] == req[4])
+	end
+	ltask.syscall(b, "quit")
+	assert(not pcall(ltask.call, p, "echo", "dead"))
+	ltask.syscall(p, "quit")
+	print "Forward handler"
+end
+
+return S
@@ -0,0 +1,83 @@
+-- The mailbox grows when the messages pile up, never holds more than the queue limit, and shrinks when it's idle.
+local ltask = require "ltask"
+
+local role, main = ...
+
+-- The same as queue in test.lua
+local QUEUE <const> = 1024
+local N <const> = QUEUE + 100
+
+local S = {}
+
+if role == "receiver" then
+	local held
+	local count = 0
+
+	-- Don't yield, so the messages after it stay in the mailbox. Give up after 5s (wall clock).
+	function S.hold()
+		local timeout = ltask.counter() + 5
+		repeat
+			held = ltask.mailbox_stat()
+		until held.length >= QUEUE or ltask.counter() > timeout
+	end
+
+	function S.push(i)
+		assert(count + 1 == i, "Out of order")
+		count = i
+		if count == N then
+			ltask.send(main, "done", held, count)
+		end
+	end
+
+	function S.stat()
+		return ltask.mailbox_stat()
+	end
+
+	return S
+end
+
+if role == "sender" then
+	function S.send(addr, n)
+		for i = 1, n do
+			ltask.send(addr, "push", i)
+		end
+	end
+
+	return S
+end
+
+local token = {}
+local result
+
+-- ltask.call fails (busy) while the messages are parked in the receiver, so it reports here.
+function S.done(held, count)
+	result = { held = held, count = count }
+	ltask.wakeup(token)
+end
+
+function S.run()
+	local receiver = ltask.spawn("mailbox", "receiver", ltask.self())
+	local sender = ltask.spawn("mailbox", "sender")
+	local init = ltask.call(receiver, "stat").capacity
+	ltask.send(receiver, "hold")
+	ltask.call(sender, "send", receiver, N)
+	if result == nil then
+		ltask.wait(token)
+	end
+	local held, count = result.held, result.count
+	assert(held.length == QUEUE, "The mailbox is not full")
+	assert(held.capacity > init, "The mailbox doesn't grow")
+	assert(count == N)
+	-- The mailbox shrinks after it's idle for a while
+	local stat
+	for i = 1, 256 do
+		stat = ltask.call(receiver, "stat")
+	end
+	assert(stat.highwater == QUEUE)
+	assert(stat.capacity < held.capacity, "The mailbox doesn't shrink")
+	ltask.syscall(sender, "quit")
+	ltask.syscall(receiver, "quit")
+	print("Mailbox", init, held.capacity, stat.capacity, "highwater", stat.highwater)
+end
+
+return S
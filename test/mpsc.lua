@@ -0,0 +1,55 @@
+-- Many services send to one at the same time, the messages from each sender must arrive in order.
+local ltask = require "ltask"
+
+local role, collector, n = ...
+
+if role == "producer" then
+	local self = ltask.self()
+	for i = 1, n do
+		ltask.send(collector, "push", self, i)
+	end
+	return
+end
+
+local PRODUCER <const> = 16
+local N <const> = 1000
+
+local S = {}
+
+local last = {}
+local total = 0
+local token = {}
+
+function S.push(from, i)
+	assert((last[from] or 0) + 1 == i, "Out of order")
+	last[from] = i
+	total = total + 1
+	if total == PRODUCER * N then
+		ltask.wakeup(token)
+	end
+end
+
+function S.run()
+	local self = ltask.self()
+	local tasks = {}
+	for i = 1, PRODUCER do
+		tasks[i] = { ltask.spawn, "mpsc", "producer", self, N }
+	end
+	for req, resp in ltask.parallel(tasks) do
+		if resp.error then
+			resp:rethrow()
+		end
+	end
+	if total < PRODUCER * N then
+		ltask.wait(token)
+	end
+	local senders = 0
+	for _, v in pairs(last) do
+		assert(v == N)
+		senders = senders + 1
+	end
+	assert(senders == PRODUCER)
+	print("MPSC", PRODUCER, "senders", total, "messages")
+end
+
+return S
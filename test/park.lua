@@ -0,0 +1,69 @@
+-- A sender floods a busy service, the messages are parked in it and then blocked in the sender, but they arrive in order.
+local ltask = require "ltask"
+
+local role, main = ...
+
+-- The same as queue in test.lua, the mailbox and the waiter list hold QUEUE messages each
+local QUEUE <const> = 1024
+local N <const> = QUEUE * 3
+
+local S = {}
+
+if role == "receiver" then
+	local count = 0
+
+	-- Don't yield, so the messages pile up. Give up after 5s (wall clock).
+	function S.hold()
+		local timeout = ltask.counter() + 5
+		repeat
+		until ltask.mailbox_stat().length >= QUEUE or ltask.counter() > timeout
+		-- Let the sender fill the waiter list
+		timeout = ltask.counter() + 0.1
+		repeat
+		until ltask.counter() > timeout
+	end
+
+	function S.push(i)
+		assert(count + 1 == i, "Out of order")
+		count = i
+		if count == N then
+			ltask.send(main, "done", count)
+		end
+	end
+
+	return S
+end
+
+if role == "sender" then
+	function S.send(addr, n)
+		for i = 1, n do
+			ltask.send(addr, "push", i)
+		end
+	end
+
+	return S
+end
+
+local token = {}
+local result
+
+function S.done(n)
+	result = n
+	ltask.wakeup(token)
+end
+
+function S.run()
+	local receiver = ltask.spawn("park", "receiver", ltask.self())
+	local sender = ltask.spawn("park", "sender")
+	ltask.send(receiver, "hold")
+	ltask.call(sender, "send", receiver, N)
+	if result == nil then
+		ltask.wait(token)
+	end
+	assert(result == N)
+	ltask.syscall(sender, "quit")
+	ltask.syscall(receiver, "quit")
+	print("Park", N, "messages")
+end
+
+return S
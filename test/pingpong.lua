@@ -0,0 +1,59 @@
+-- Two services keep waking each other, the others must still be scheduled.
+local ltask = require "ltask"
+
+local role = ...
+
+local S = {}
+
+if role == "ball" then
+	local peer
+	local stop
+	local count = 0
+
+	function S.peer(addr)
+		peer = addr
+	end
+
+	function S.ball()
+		if not stop then
+			count = count + 1
+			ltask.send(peer, "ball")
+		end
+	end
+
+	function S.stop()
+		stop = true
+		return count
+	end
+
+	return S
+end
+
+if role == "echo" then
+	function S.echo(...)
+		return ...
+	end
+
+	return S
+end
+
+function S.run()
+	local a = ltask.spawn("pingpong", "ball")
+	local b = ltask.spawn("pingpong", "ball")
+	ltask.call(a, "peer", b)
+	ltask.call(b, "peer", a)
+	ltask.send(a, "ball")
+	ltask.sleep(1)
+	-- spawn runs root and the new service
+	local echo = ltask.spawn("pingpong", "echo")
+	assert(ltask.call(echo, "echo", "hello") == "hello")
+	local na = ltask.call(a, "stop")
+	local nb = ltask.call(b, "stop")
+	assert(na > 0 and nb > 0)
+	print("Ping-pong", na + nb, "times while the others run")
+	for _, addr in ipairs { a, b, echo } do
+		ltask.syscall(addr, "quit")
+	end
+end
+
+return S
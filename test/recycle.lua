@@ -0,0 +1,40 @@
+-- The slot of a dead service is reused with a new generation, the messages to the old id never reach the new one.
+local ltask = require "ltask"
+
+local role = ...
+
+-- The same as max_service in test.lua
+local MAX_SERVICE <const> = 256
+
+local S = {}
+
+if role == "echo" then
+	function S.echo()
+		return ltask.self()
+	end
+
+	return S
+end
+
+function S.run()
+	local old = ltask.spawn("recycle", "echo")
+	ltask.syscall(old, "quit")
+	local slot = old % MAX_SERVICE
+	local new
+	for _ = 1, MAX_SERVICE * 4 do
+		local addr = ltask.spawn("recycle", "echo")
+		if addr % MAX_SERVICE == slot then
+			new = addr
+			break
+		end
+		ltask.syscall(addr, "quit")
+	end
+	assert(new and new ~= old, "The slot is not reused")
+	local ok, err = pcall(ltask.call, old, "echo")
+	assert(not ok and tostring(err):find "dead", "The old id reaches the new service")
+	assert(ltask.call(new, "echo") == new)
+	ltask.syscall(new, "quit")
+	print("Recycle", old, new)
+end
+
+return S
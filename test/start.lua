@@ -33,7 +33,8 @@ local filename, err = package.searchpath(name, "${service_path}")
 if not filename then
 	return nil, err
 end
-return loadfile(filename)
+-- the compiled chunk is shared by the services loading the same file
+return require "ltask".loadfile(filename)
 ]=]):gsub("%$%{([^}]*)%}", {
 			lua_path = package.path,
 			lua_cpath = package.cpath,
@@ -42,6 +42,8 @@ function S.ping(...)
 	ltask.timeout(10, function() print(1) end)
 	ltask.timeout(20, function() print(2) end)
 	ltask.timeout(30, function() print(3) end)
+	local cancel = ltask.timeout(35, function() print "Cancelled timeout" end)
+	assert(ltask.cancel_timeout(cancel))
 	local t = ltask.counter()
 	ltask.sleep(40) -- sleep 0.4 sec
 	print("TIME:", ltask.counter() - t)
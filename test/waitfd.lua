@@ -0,0 +1,68 @@
+-- Two coroutines wait for read and write of one fd (a fifo opened for both)
+local ltask = require "ltask"
+
+local role = ...
+
+local S = {}
+
+if role == "other" then
+	function S.cancel(fd)
+		return pcall(ltask.cancel_fd, fd)
+	end
+
+	return S
+end
+
+function S.run()
+	if not pcall(ltask.cancel_fd, -1) then
+		print "Reactor is not enabled, skip waitfd"
+		return
+	end
+	local filename = os.tmpname()
+	os.remove(filename)
+	assert(os.execute("mkfifo " .. filename))
+	local fd = assert(ltask.io.open(filename, "r+"))
+	os.remove(filename)	-- the fifo is kept until fd is closed
+
+	local readable
+	local reader = {}
+	ltask.fork(function ()
+		readable = ltask.wait_fd(fd, "r")
+		ltask.wakeup(reader)
+	end)
+	ltask.sleep(0)
+	-- The fifo is empty, the reader is still waiting
+	local _, writable = ltask.wait_fd(fd, "w")
+	assert(writable)
+	assert(readable == nil)
+	assert(not pcall(ltask.wait_fd, fd, "r"), "Only one can wait for read")
+	assert(ltask.io.write(fd, "x") == 1)
+	if readable == nil then
+		ltask.wait(reader)
+	end
+	assert(readable)
+	assert(ltask.io.read(fd, 1) == "x")
+
+	-- cancel_fd wakes up the waiting ones with error
+	local err
+	ltask.fork(function ()
+		local _, _, e = ltask.wait_fd(fd, "r")
+		err = e
+		ltask.wakeup(reader)
+	end)
+	ltask.sleep(0)
+	-- Only the waiting service can cancel it
+	local other = ltask.spawn("waitfd", "other")
+	assert(not ltask.call(other, "cancel", fd), "Cancel fd of another service")
+	ltask.syscall(other, "quit")
+	assert(err == nil)
+	ltask.cancel_fd(fd)
+	if err == nil then
+		ltask.wait(reader)
+	end
+	assert(err)
+	ltask.io.close(fd)
+	print "Wait fd for read and write"
+end
+
+return S